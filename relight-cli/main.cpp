@@ -23,7 +23,7 @@ using namespace std;
 void help() {
 	cout << "Create an RTI from a set of images and a set of light directions (.lp) in a folder.\n";
 	cout << "It is also possible to convert from .ptm or .rti to relight format and viceversa.\n\n";
-	cout << "Usage: relight-cli [-bpqy3PnmMwkrsSRBcCeEv]<input folder> [output folder]\n\n";
+	cout << "Usage: relight-cli [-bpqy3PnmMwtkrsSRBcCeEv]<input folder> [output folder]\n\n";
 	cout << "       relight-cli [-q] <input.ptm|.rti> [output folder]\n\n";
 	cout << "       relight-cli [-q] <input.json> [output.ptm]\n\n";
     cout << "\tinput folder containing a .lp with number of photos and light directions\n";
@@ -41,12 +41,31 @@ void help() {
 	cout << "\t-M        : extract median image (7/8th quantile) \n";
 
 	cout << "\t-w        : number of workers (default 8)\n";
+	cout << "\t-t <int>  : number of threads decoding the images (default 8)\n";
+	cout << "\t-j <int>  : number of threads compressing each plane in stripes, files are a bit larger (default 1)\n";
+	cout << "\t-Z <deepzoom|tarzoom>: tile the planes while fitting (256, no overlap) instead of saving plane jpegs\n";
 	cout << "\t-k <int>x<int>+<int>+<int>: Cropping extracts only the widthxheight+offx+offy part\n";
+	cout << "\t-x <int>  : preview, decode the images at 1/2, 1/4 or 1/8 resolution\n";
+	cout << "\t-K <file> : light stack cache, written on the first run and reused by the next ones\n";
+	cout << "\t-I        : memory map the images instead of keeping a file open for each one (on windows they are read in RAM)\n";
+	cout << "\t-A <path> : reuse basis and quantization of a previous rti (info.json or folder), no sampling\n";
+	cout << "\t-O        : ptm, hsh, sh, h: decode the images once, coefficients are kept in a temporary file\n";
+	cout << "\t-W <basis[:planes[:yplanes]],...>: sweep, print size and psnr (csv) of each configuration sampling once\n";
+	cout << "\t-J <int,...>: jpeg qualities of the sweep (default: -q)\n";
+	cout << "\t-G <float>: save the smallest configuration of the sweep with at least this psnr\n";
+	cout << "\t-a <float>: jpeg quality of each plane (at most -q) for the smallest size with this estimated psnr\n";
+	cout << "\t-V <float>: keep this fraction of the samples (eg. 0.05) out of the fit and print their psnr (quantized, before jpeg)\n";
+	cout << "\t-X <int>  : cross validation, refit leaving out this many lights at a time and print the psnr of each, no output\n";
+	cout << "\t-T <float>: rbf, bilinear: use the fewest planes retaining this fraction of the variance (eg. 0.999)\n";
+	cout << "\t-Q <float>: rbf, bilinear: use the fewest planes with this estimated psnr (before quantization)\n";
 
     cout << "\nIgnore exotic parameters below here\n\n";
 	cout << "\n-H        : fix overexposure in ptm and hsh due to bad sampling\n";
     cout << "\t-r <int>  : side of the basis function (default 8, 0 means rbf interpolation)\n";
 	cout << "\t-s <int>  : sampling RAM for pca  in MB (default 500MB)\n";
+	cout << "\t-z <int>  : bits per channel of the pca samples: 8, 16 or 32 (float), default automatic\n";
+	cout << "\t-i        : importance sampling, more pca samples where luminance varies across lights\n";
+	cout << "\t-Y <int>  : number of rows decoded for pca sampling, the others are skipped (default all)\n";
     cout << "\t-S <float>: sigma in rgf gaussian interpolation default 0.125 (~100 img)\n";
     cout << "\t-R <float>: regularization coeff for bilinear default 0.1\n";
     cout << "\t-B <float>: range compress bits for planes (default 0.0) 1.0 means compress\n";
@@ -83,6 +102,86 @@ void test(std::string input, std::string output,  Vector3f light) {
     img.save(output.c_str());
 }
 
+//basis as in -b into type and colorspace.
+bool parseBasis(const string &b, Rti::Type &type, Rti::ColorSpace &colorspace) {
+	static map<string, pair<Rti::Type, Rti::ColorSpace>> bases = {
+		{ "rbf",       { Rti::RBF,      Rti::MRGB } },
+		{ "bilinear",  { Rti::BILINEAR, Rti::MRGB } },
+		{ "bln",       { Rti::BILINEAR, Rti::MRGB } },
+		{ "hsh",       { Rti::HSH,      Rti::RGB  } },
+		{ "sh",        { Rti::SH,       Rti::RGB  } },
+		{ "h",         { Rti::H,        Rti::RGB  } },
+		{ "lhsh",      { Rti::HSH,      Rti::LRGB } },
+		{ "ptm",       { Rti::PTM,      Rti::RGB  } },
+		{ "lptm",      { Rti::PTM,      Rti::LRGB } },
+		{ "yrbf",      { Rti::RBF,      Rti::MYCC } },
+		{ "ybilinear", { Rti::BILINEAR, Rti::MYCC } },
+		{ "ybln",      { Rti::BILINEAR, Rti::MYCC } },
+		{ "yptm",      { Rti::PTM,      Rti::YCC  } },
+		{ "yhsh",      { Rti::HSH,      Rti::YCC  } },
+		{ "dmd",       { Rti::DMD,      Rti::RGB  } }
+	};
+	auto it = bases.find(b);
+	if(it == bases.end())
+		return false;
+	type = it->second.first;
+	colorspace = it->second.second;
+	return true;
+}
+
+//sweep configurations: basis[:planes[:yplanes]] comma separated, each with every quality.
+bool parseSweep(const QString &spec, const QString &qualities, int quality, vector<RtiBuilder::SweepConfig> &configs) {
+	vector<int> qs;
+	for(QString q: qualities.split(','))
+		if(!q.isEmpty())
+			qs.push_back(q.toInt());
+	if(qs.empty())
+		qs.push_back(quality);
+
+	for(QString c: spec.split(',')) {
+		if(c.isEmpty())
+			continue;
+		QStringList parts = c.split(':');
+		RtiBuilder::SweepConfig config;
+		if(!parseBasis(parts[0].toStdString(), config.type, config.colorspace) || config.type == Rti::H || config.type == Rti::DMD) {
+			cerr << "Unsupported basis in sweep: " << qPrintable(parts[0]) << endl;
+			return false;
+		}
+		//fixed by the basis for ptm and hsh.
+		switch(config.type) {
+		case Rti::PTM: config.nplanes = config.colorspace == Rti::LRGB ? 9 : 18; break;
+		case Rti::HSH: config.nplanes = config.colorspace == Rti::LRGB ? 12 : 27; break;
+		case Rti::SH:  config.nplanes = 27; break;
+		default: break;
+		}
+		bool pca = config.type == Rti::RBF || config.type == Rti::BILINEAR;
+		if(parts.size() > 1) {
+			if(!pca) {
+				cerr << "The number of planes is fixed by the basis in sweep: " << qPrintable(c) << endl;
+				return false;
+			}
+			config.nplanes = parts[1].toUInt();
+			//the dimensions (lights or resolution) are checked against the planes by the sweep.
+			if(config.nplanes == 0 || config.nplanes % 3 != 0) {
+				cerr << "Planes in sweep must be a multiple of 3: " << qPrintable(c) << endl;
+				return false;
+			}
+		}
+		if(config.colorspace == Rti::MYCC) {
+			config.yccplanes = parts.size() > 2 ? parts[2].toUInt() : config.nplanes/3;
+			if(config.nplanes % 3 != 0 || config.yccplanes > config.nplanes || (config.nplanes - config.yccplanes) % 2 != 0) {
+				cerr << "Invalid planes in sweep: " << qPrintable(c) << endl;
+				return false;
+			}
+		}
+		for(int q: qs) {
+			config.quality = q;
+			configs.push_back(config);
+		}
+	}
+	return true;
+}
+
 bool progress(string str, int n) {
 	static string previous = "";
 	if(previous == str) cout << '\r';
@@ -109,10 +208,11 @@ int main(int argc, char *argv[]) {
     Vector3f light;
 	bool verbose = true;
 	bool histogram_fix = false;
+	QString sweep, sweep_qualities;
 
 	opterr = 0;
     char c;
-	while ((c  = getopt (argc, argv, "hmMn3:r:d:q:p:s:c:reE:b:y:S:R:CD:B:L:k:P:v")) != -1)
+	while ((c  = getopt (argc, argv, "hmMn3:r:d:q:p:s:z:iY:c:reE:b:y:S:R:CD:B:L:k:K:IA:OW:J:G:T:Q:a:V:X:P:t:j:Z:x:v")) != -1)
         switch (c)
         {
         case 'h':
@@ -146,65 +246,11 @@ int main(int argc, char *argv[]) {
 		return 1;
 	    }
             break;
-        case 'b': {
-            string b = optarg;
-            if(b == "rbf") {
-                builder.type = RtiBuilder::RBF;
-                builder.colorspace = RtiBuilder::MRGB;
-
-            } else if(b == "bilinear" || b == "bln") {
-                builder.type = RtiBuilder::BILINEAR;
-                builder.colorspace = RtiBuilder::MRGB;
-
-            } else if(b == "hsh") {
-                builder.type = RtiBuilder::HSH;
-                builder.colorspace = RtiBuilder::RGB;
-
-			} else if(b == "sh") {
-				builder.type = RtiBuilder::SH;
-				builder.colorspace = RtiBuilder::RGB;
-
-			} else if(b == "h") {
-				builder.type = RtiBuilder::H;
-				builder.colorspace = RtiBuilder::RGB;
-
-            } else if(b == "lhsh") {
-                builder.type = RtiBuilder::HSH;
-                builder.colorspace = RtiBuilder::LRGB;
-
-            } else if(b == "ptm") {
-                builder.type = RtiBuilder::PTM;
-                builder.colorspace = RtiBuilder::RGB;
-
-            } else if(b == "lptm") {
-                builder.type = RtiBuilder::PTM;
-                builder.colorspace = RtiBuilder::LRGB;
-
-            } else if(b == "yrbf") {
-                builder.type = RtiBuilder::RBF;
-                builder.colorspace = RtiBuilder::MYCC;
-
-            } else if(b == "ybilinear" || b == "ybln") {
-                builder.type = RtiBuilder::BILINEAR;
-                builder.colorspace = RtiBuilder::MYCC;
-
-            } else if(b == "yptm") {
-                builder.type = RtiBuilder::PTM;
-                builder.colorspace = RtiBuilder::YCC;
-
-            } else if(b == "yhsh") {
-                builder.colorspace = RtiBuilder::YCC;
-                builder.type = RtiBuilder::HSH;
-
-            } else if(b == "dmd") {
-                builder.colorspace = RtiBuilder::RGB;
-                builder.type = RtiBuilder::DMD;
-
-            } else {
+        case 'b':
+            if(!parseBasis(optarg, builder.type, builder.colorspace)) {
                 cerr << "Unknown basis type: " << optarg << " (pick rbf, ptm, lptm, hsh, yrbf or bilinear!)\n" << endl;
                 return 1;
             }
-        }
             break;
 			/*		case 'd':c
             encoder.distortion = atof(optarg);
@@ -221,6 +267,15 @@ int main(int argc, char *argv[]) {
 		case 'w':
 			builder.nworkers = std::min(atoi(optarg), 1);
 			break;
+		case 't': {
+			int nthreads = atoi(optarg);
+			if(nthreads < 1) {
+				cerr << "Invalid number of decoding threads (-t): " << optarg << endl;
+				return 1;
+			}
+			builder.imageset.decode_threads = nthreads;
+			break;
+		}
         case 'e':
             evaluate_error = true;
             break;
@@ -240,6 +295,21 @@ int main(int argc, char *argv[]) {
         case 's':
 			builder.samplingram = uint32_t(atoi(optarg));
             break;
+		case 'i':
+			builder.imageset.importance_sampling = true;
+			break;
+		case 'Y':
+			builder.imageset.sampling_rows = atoi(optarg);
+			break;
+		case 'z': {
+			int bits = atoi(optarg);
+			if(bits != 8 && bits != 16 && bits != 32) {
+				cerr << "Sample bits must be 8, 16 or 32!\n" << endl;
+				return 1;
+			}
+			builder.samplebits = bits;
+			break;
+		}
         case 'S': {
             float sigma = float(atof(optarg));
             if(sigma > 0)
@@ -262,6 +332,90 @@ int main(int argc, char *argv[]) {
 			}
 			break;
 		}
+		case 'K':
+			builder.imageset.cache_path = optarg;
+			break;
+		case 'I':
+			builder.imageset.in_memory = true;
+			break;
+		case 'A':
+			builder.basisfile = optarg;
+			break;
+		case 'O':
+			builder.onepass = true;
+			break;
+		case 'W':
+			sweep = optarg;
+			break;
+		case 'J':
+			sweep_qualities = optarg;
+			break;
+		case 'G':
+			builder.sweep_psnr = atof(optarg);
+			break;
+		case 'a':
+			builder.rd_psnr = atof(optarg);
+			break;
+		case 'V': {
+			double holdout = atof(optarg);
+			if(holdout <= 0 || holdout >= 0.5) {
+				cerr << "Held out fraction must be in (0, 0.5)!\n" << endl;
+				return 1;
+			}
+			builder.holdout = holdout;
+			break;
+		}
+		case 'X': {
+			int k = atoi(optarg);
+			if(k <= 0) {
+				cerr << "Number of lights left out must be > 0!\n" << endl;
+				return 1;
+			}
+			builder.crossvalidation = uint32_t(k);
+			break;
+		}
+		case 'T': {
+			double energy = atof(optarg);
+			if(energy <= 0 || energy > 1) {
+				cerr << "Target energy must be in (0, 1]!\n" << endl;
+				return 1;
+			}
+			builder.target_energy = energy;
+			break;
+		}
+		case 'Q':
+			builder.target_psnr = atof(optarg);
+			break;
+		case 'j': {
+			int threads = atoi(optarg);
+			if(threads < 1) {
+				cerr << "Invalid number of jpeg threads (-j): " << optarg << endl;
+				return 1;
+			}
+			builder.jpeg_threads = threads;
+			break;
+		}
+		case 'Z': {
+			QString pyramid(optarg);
+			if(pyramid == "deepzoom")
+				builder.pyramid = RtiBuilder::DEEPZOOM;
+			else if(pyramid == "tarzoom")
+				builder.pyramid = RtiBuilder::TARZOOM;
+			else {
+				cerr << "Unknown pyramid format (-Z): " << optarg << ", use deepzoom or tarzoom" << endl;
+				return 1;
+			}
+			break;
+		}
+		case 'x': {
+			int scale = atoi(optarg);
+			if(scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+				cerr << "Preview scale must be 1, 2, 4 or 8!\n" << endl;
+				return 1;
+			}
+			builder.imageset.scale = scale;
+			break;
+		}
 		case 'H': {
 			builder.histogram_fix = true;
 			break;
@@ -338,6 +492,11 @@ int main(int argc, char *argv[]) {
 
 	/* Sanity checks, TODO: move into RTI builder! */
 
+	if(builder.pyramid != RtiBuilder::NOPYRAMID && (evaluate_error || !redrawdir.isNull())) {
+		cerr << "Error evaluation and redraw need the plane jpegs, not available with -Z\n";
+		return 1;
+	}
+
 	switch(builder.type) {
 	case Rti::PTM:
 		if(builder.colorspace == Rti::LRGB && builder.nplanes != 9) {
@@ -358,7 +517,7 @@ int main(int argc, char *argv[]) {
 	default: break;
 	}
 
-    if( builder.colorspace == Rti::MYCC) {
+    if( builder.colorspace == Rti::MYCC && builder.target_energy == 0 && builder.target_psnr == 0) {
         if(builder.yccplanes[0] == 0) {
 			cerr << "Y nplanes in mycc must be specified (-y)!\n";
             return 1;
@@ -376,6 +535,9 @@ int main(int argc, char *argv[]) {
 
     }
 
+	if(!sweep.isEmpty() && !parseSweep(sweep, sweep_qualities, quality, builder.sweeps))
+		return 1;
+
     std::string input = argv[optind++];
     std::string output("./");
     if(optind < argc)
@@ -428,6 +590,35 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if(builder.crossvalidation) {
+		double total = 0.0;
+		cout << "\nimage,x,y,z,psnr" << endl;
+		for(size_t i = 0; i < builder.crossvalidation_mse.size(); i++) {
+			double mse = builder.crossvalidation_mse[i];
+			total += mse;
+			Vector3f &light = builder.lights[i];
+			cout << (i < size_t(builder.imageset.images.size()) ? qPrintable(builder.imageset.images[i]) : "") << ","
+				 << light[0] << "," << light[1] << "," << light[2] << ","
+				 << 20*log10(255.0) - 10*log10(std::max(mse, 1e-10)) << endl;
+		}
+		total /= std::max<size_t>(1, builder.crossvalidation_mse.size());
+		cout << "all,,,," << 20*log10(255.0) - 10*log10(std::max(total, 1e-10)) << endl;
+		return 0;
+	}
+
+	if(builder.sweeps.size()) {
+		map<Rti::Type, string> types = { { Rti::PTM, "ptm" }, {Rti::HSH, "hsh"}, {Rti::SH, "sh"}, {Rti::RBF, "rbf"}, { Rti::BILINEAR, "bilinear"} };
+		map<Rti::ColorSpace, string> colorspaces = { { Rti::RGB, "rgb"}, { Rti::LRGB, "lrgb" }, { Rti::YCC, "ycc"}, { Rti::MRGB, "mrgb"}, { Rti::MYCC, "mycc" } };
+
+		cout << "\nbasis,colorspace,planes,yplanes,quality,size,psnr,pareto" << endl;
+		for(RtiBuilder::SweepConfig &c: builder.sweeps)
+			cout << types[c.type] << "," << colorspaces[c.colorspace] << "," << c.nplanes << "," << c.yccplanes << ","
+				 << c.quality << "," << c.size << "," << c.psnr << "," << (c.pareto ? 1 : 0) << endl;
+		if(builder.sweep_psnr <= 0)
+			return 0;
+		quality = builder.quality;
+	}
+
     int size = builder.save(output, quality);
     if(size == 0) {
         cerr << "Failed saving: " << builder.error << " !\n" << endl;
@@ -440,6 +631,14 @@ int main(int argc, char *argv[]) {
 	else
 		cout << "\nDone in: " << time/1000 << "s" << endl;
 
+	if(builder.heldout_mse.size()) {
+		cout << "\nEstimated PSNR (held out samples): " << builder.heldout_psnr << endl;
+		for(size_t i = 0; i < builder.heldout_mse.size() && i < size_t(builder.imageset.images.size()); i++) {
+			double psnr = 20*log10(255.0) - 10*log10(std::max(builder.heldout_mse[i], 1e-10));
+			cout << qPrintable(builder.imageset.images[i]) << "," << psnr << endl;
+		}
+	}
+
     if(redrawdir.size()) {
         Rti rti;
         if(!rti.load(output.c_str())) {
@@ -36,6 +36,7 @@ SOURCES += main.cpp \
     ../src/imageset.cpp \
     ../src/jpeg_decoder.cpp \
     ../src/jpeg_encoder.cpp \
+    ../src/deepzoom.cpp \
     ../src/rti.cpp \
     ../src/legacy_rti.cpp \
     rtibuilder.cpp \
@@ -47,6 +48,7 @@ HEADERS += \
     ../src/imageset.h \
     ../src/jpeg_decoder.h \
     ../src/jpeg_encoder.h \
+    ../src/deepzoom.h \
     ../src/material.h \
     ../src/vector.h \
     ../src/rti.h \
@@ -6,6 +6,7 @@
 
 #include <QDir>
 #include <QFile>
+#include <QTemporaryFile>
 #include <QStringList>
 #include <QTextStream>
 #include <QImage>
@@ -17,9 +18,9 @@
 
 #include "../src/jpeg_decoder.h"
 #include "../src/jpeg_encoder.h"
+#include "../src/deepzoom.h"
 
 //#include "../src/pca.h"
-#include "../src/eigenpca.h"
 
 #include <Eigen/Core>
 
@@ -68,7 +69,9 @@ static Vector3f fromOcta(int x, int y, int resolution) {
 	return n;
 }
 RtiBuilder::RtiBuilder() {}
-RtiBuilder::~RtiBuilder() {}
+RtiBuilder::~RtiBuilder() {
+	delete spill;
+}
 
 bool RtiBuilder::initFromFolder(const string &folder, std::function<bool(std::string stage, int percent)> *_callback) {
 	
@@ -152,6 +155,9 @@ void RtiBuilder::savePixel(Color3f *p, int side, const QString &file) {
 */
 
 bool RtiBuilder::init(std::function<bool(std::string stage, int percent)> *_callback) {
+	if(!basisfile.empty() && !loadBasis(basisfile))
+		return false;
+
 	if((type == PTM || type == HSH || type == SH || type == H) && colorspace == MRGB) {
 		error = "PTM and HSH do not support MRGB";
 		return false;
@@ -164,7 +170,9 @@ bool RtiBuilder::init(std::function<bool(std::string stage, int percent)> *_call
 
 	callback = _callback;
 
-
+	//preview: pixels are scale times larger.
+	if(pixelSize > 0)
+		pixelSize *= imageset.scale;
 
 	if(type == BILINEAR) {
 		ndimensions = resolution*resolution;
@@ -179,14 +187,100 @@ bool RtiBuilder::init(std::function<bool(std::string stage, int percent)> *_call
 
 	imageset.setCallback(callback);
 
+	if(!basisfile.empty()) {
+		//basis and quantization come from the reference: PTM and HSH bases only depend on the lights.
+		if(type != RBF && type != BILINEAR) {
+			SampleArray none;
+			pickBases(none);
+		}
+		return true;
+	}
+
+	if(crossvalidation)
+		return crossValidate();
+
+	if(sweeps.size())
+		return sweep();
+
+	if(onePass()) {
+		//PTM and HSH bases only depend on the lights, quantization is computed on all the pixels while saving.
+		SampleArray none;
+		pickBases(none);
+		return true;
+	}
+
 	try {
 		//we don't actually need to store the samples, we can just add to (resample) add to PCA, or use to compute material.
 		//collect a set of samples resampled
-		PixelArray resample;
-		imageset.sample(resample, ndimensions, [&](Pixel &sample, Pixel &resample) { this->resamplePixel(sample, resample); }, samplingram);
+		SampleArray resample(sampleBits());
+		sampleRange(resample);
+
+		//one every 'every' samples is kept out of the fit (as read, all the lights) to estimate the error.
+		uint32_t every = holdout > 0 ? std::max<uint32_t>(2, uint32_t(round(1.0/holdout))) : 0;
+		auto held = [&](uint32_t i) { return every && i % every == 0; };
+		SampleArray heldout(16);
+		sampleRange(heldout);
+		uint32_t sampled = 0;
+		auto resampler = [&](PixelArray &sample, PixelArray &resample) {
+			this->resamplePixels(sample, resample);
+			for(uint32_t x = 0; x < sample.npixels(); x++) {
+				if(!held(sampled + x))
+					continue;
+				size_t n = heldout.npixels();
+				heldout.resize(n + 1, lights.size());
+				heldout.store(n, sample[x]);
+			}
+			sampled += sample.npixels();
+		};
+
+		std::function<void(PixelArray &)> consume = nullptr;
+		PixelArray fitted;
+		covariances.clear();
+		if(type == RBF || type == BILINEAR) {
+			covariances.resize(std::max<size_t>(1, nworkers)*(colorspace == MYCC ? 3 : 1));
+			consume = [&](PixelArray &resampled) {
+				if(!every) {
+					this->accumulateCovariance(resampled);
+					return;
+				}
+				uint32_t start = sampled - resampled.npixels();
+				fitted.resize(resampled.npixels(), ndimensions);
+				uint32_t n = 0;
+				for(uint32_t i = 0; i < resampled.npixels(); i++) {
+					if(held(start + i))
+						continue;
+					Pixel s = resampled[i];
+					Pixel d = fitted[n++];
+					d.x = s.x;
+					d.y = s.y;
+					std::copy(s.begin(), s.end(), d.begin());
+				}
+				fitted.resize(n, ndimensions);
+				this->accumulateCovariance(fitted);
+			};
+		}
+		imageset.sample(resample, ndimensions, resampler, samplingram, consume);
+		if(every) {
+			PixelArray pixel(1, ndimensions);
+			uint32_t n = 0;
+			for(uint32_t i = 0; i < resample.npixels(); i++) {
+				if(held(i))
+					continue;
+				resample.load(i, pixel[0]);
+				resample.store(n++, pixel[0]);
+			}
+			resample.resize(n, ndimensions);
+		}
 		nsamples = resample.npixels();
+		reduceCovariances();
+		if(target_energy > 0 || target_psnr > 0)
+			choosePlanes();
 
 		pickBases(resample);
+		minmaxMaterial(resample);
+		finalizeMaterial();
+		if(every)
+			estimateHeldout(heldout);
 	} catch(std::exception &e) {
 		error = "Could not create a base.";
 		return false;
@@ -197,9 +291,659 @@ bool RtiBuilder::init(std::function<bool(std::string stage, int percent)> *_call
 	return true;
 }
 
+void RtiBuilder::reduceCovariances() {
+	//reduce the partial covariances of the threads.
+	uint32_t ncov = colorspace == MYCC ? 3 : 1;
+	for(size_t i = ncov; i < covariances.size(); i++)
+		covariances[i % ncov].merge(covariances[i]);
+	covariances.resize(std::min<size_t>(ncov, covariances.size()));
+}
+
+void RtiBuilder::choosePlanes() {
+	if(type != RBF && type != BILINEAR) {
+		cerr << "Target energy or psnr only apply to rbf and bilinear, planes are fixed for the other bases.\n";
+		return;
+	}
+	//residual variance of each component (Y, Cb, Cr for MYCC) keeping n planes.
+	double total = 0.0;
+	for(PCA &pca: covariances)
+		total += pca.variance();
+	//psnr over the resampled values, the residual is the squared error summed over a pixel.
+	double values = double(ndimensions)*3;
+	auto reached = [&](double residual) {
+		if(target_energy > 0 && residual > (1.0 - target_energy)*total)
+			return false;
+		if(target_psnr > 0 && residual > 0 && 10*log10(255.0*255.0*values/residual) < target_psnr)
+			return false;
+		return true;
+	};
+
+	//planes are saved in triplets.
+	uint32_t dim = colorspace == MYCC ? ndimensions : ndimensions*3;
+	uint32_t maxplanes = colorspace == MYCC ? 3*ndimensions : 3*(dim/3);
+	for(uint32_t n = 3; n <= maxplanes; n += 3) {
+		if(colorspace == MRGB) {
+			if(!reached(covariances[0].residual(n)) && n + 3 <= maxplanes)
+				continue;
+			nplanes = n;
+			break;
+		}
+		//MYCC: split n = y + 2c with c <= y <= dim, pick the split with the lowest residual.
+		double best = -1.0;
+		uint32_t besty = 0;
+		for(uint32_t c = 0; 3*c <= n; c++) {
+			uint32_t y = n - 2*c;
+			if(y > dim || c > dim)
+				continue;
+			double residual = covariances[0].residual(y) + covariances[1].residual(c) + covariances[2].residual(c);
+			if(best < 0 || residual < best) {
+				best = residual;
+				besty = y;
+			}
+		}
+		if(best < 0 || (!reached(best) && n + 3 <= maxplanes))
+			continue;
+		nplanes = n;
+		yccplanes[0] = besty;
+		yccplanes[1] = yccplanes[2] = (n - besty)/2;
+		break;
+	}
+}
+
+void RtiBuilder::sampleLights(SampleArray &raw) {
+	imageset.sample(raw, lights.size(), [](PixelArray &sample, PixelArray &resampled) {
+		for(uint32_t x = 0; x < sample.npixels(); x++) {
+			Pixel s = sample[x];
+			Pixel r = resampled[x];
+			r.x = s.x;
+			r.y = s.y;
+			std::copy(s.begin(), s.end(), r.begin());
+		}
+	}, samplingram);
+}
+
+bool RtiBuilder::crossValidate() {
+	if(imageset.light3d) {
+		error = "Cross validation supports only directional lights.";
+		return false;
+	}
+	if(crossvalidation >= lights.size()) {
+		error = "Cross validation must leave out fewer lights than the images.";
+		return false;
+	}
+	SweepConfig current;
+	current.type = type;
+	current.colorspace = colorspace;
+	current.nplanes = nplanes;
+	current.yccplanes = yccplanes[0];
+
+	vector<Vector3f> all = lights;
+	bool ok = true;
+	try {
+		SampleArray raw(samplebits ? samplebits : 16);
+		sampleRange(raw);
+		sampleLights(raw);
+
+		//fold f holds out the lights i % nfolds == f, spread across the dome.
+		uint32_t n = all.size();
+		uint32_t nfolds = (n + crossvalidation - 1)/crossvalidation;
+		crossvalidation_mse.assign(n, 0.0);
+		vector<uint32_t> kept, held;
+		PixelArray subset;
+		auto select = [&](PixelArray &pixels) {
+			subset.resize(pixels.npixels(), kept.size());
+			for(uint32_t i = 0; i < pixels.npixels(); i++) {
+				Pixel s = pixels[i];
+				Pixel d = subset[i];
+				d.x = s.x;
+				d.y = s.y;
+				for(size_t k = 0; k < kept.size(); k++)
+					d[k] = s[kept[k]];
+			}
+		};
+
+		vector<vector<uint8_t>> line;
+		vector<uint8_t> rendered;
+		for(uint32_t f = 0; f < nfolds; f++) {
+			if(callback && !(*callback)("Cross validation:", 100*f/nfolds))
+				throw std::string("Cancelled.");
+
+			kept.clear();
+			held.clear();
+			for(uint32_t i = 0; i < n; i++)
+				(i % nfolds == f ? held : kept).push_back(i);
+			lights.clear();
+			for(uint32_t k: kept)
+				lights.push_back(all[k]);
+			imageset.lights = lights;
+			setConfiguration(current);
+
+			//the basis is fitted on the shared sample without the held out lights.
+			SampleArray fit(raw.bits);
+			sampleRange(fit);
+			fit.resize(raw.npixels(), kept.size());
+			scanSamples(raw, [&](uint32_t start, PixelArray &pixels) {
+				select(pixels);
+				for(uint32_t i = 0; i < subset.npixels(); i++)
+					fit.store(start + i, subset[i]);
+			});
+			fitSamples(fit);
+			exportMaterial();
+
+			//the quantized planes are rendered in the direction of the held out lights.
+			Rti rti(*this);
+			rti.height = 1;
+			rti.planes.resize(nplanes);
+			scanSamples(raw, [&](uint32_t /*start*/, PixelArray &pixels) {
+				select(pixels);
+				uint32_t npixels = pixels.npixels();
+				quantizeProbe(subset, line);
+				rti.width = npixels;
+				for(uint32_t p = 0; p < nplanes; p++) {
+					rti.planes[p].resize(npixels);
+					for(uint32_t i = 0; i < npixels; i++)
+						rti.planes[p][i] = line[p/3][i*3 + p%3];
+				}
+
+				rendered.resize(size_t(npixels)*3);
+				for(uint32_t h: held) {
+					rti.render(all[h][0], all[h][1], rendered.data());
+					double e = 0.0;
+					for(uint32_t i = 0; i < npixels; i++) {
+						Color3f &original = pixels[i][h];
+						for(int c = 0; c < 3; c++) {
+							double d = std::min(255.0f, original[c]) - rendered[i*3 + c];
+							e += d*d;
+						}
+					}
+					crossvalidation_mse[h] += e/(double(raw.npixels())*3);
+				}
+			});
+		}
+	} catch(std::string e) {
+		error = e;
+		ok = false;
+	} catch(...) {
+		error = "Could not create a base.";
+		ok = false;
+	}
+	//no basis is left fitted.
+	lights = imageset.lights = all;
+	setConfiguration(current);
+	return ok;
+}
+
+bool RtiBuilder::sweep() {
+	//pca planes can not exceed the dimensions of the samples.
+	for(SweepConfig &config: sweeps) {
+		if(config.type != RBF && config.type != BILINEAR)
+			continue;
+		uint32_t dims = config.type == BILINEAR ? resolution*resolution : uint32_t(lights.size());
+		bool fits = config.colorspace == MYCC ?
+					config.yccplanes <= dims && (config.nplanes - config.yccplanes)/2 <= dims :
+					config.nplanes <= dims*3;
+		if(!fits) {
+			error = "Too many planes in sweep (" + std::to_string(config.nplanes) + ") for " + std::to_string(dims) + " dimensions.";
+			return false;
+		}
+	}
+	try {
+		//all the lights are sampled once (intensity corrected), each configuration resamples them.
+		SampleArray raw(samplebits ? samplebits : 16);
+		sampleRange(raw);
+		sampleLights(raw);
+
+		//size and psnr are measured on a few strips of rows across the image.
+		PixelArray probe;
+		uint32_t probe_rows = readProbe(probe);
+
+		SweepConfig *fitted = nullptr;
+		for(size_t i = 0; i < sweeps.size(); i++) {
+			if(callback && !(*callback)("Sweep:", 100*i/sweeps.size()))
+				throw std::string("Cancelled.");
+
+			SweepConfig &config = sweeps[i];
+			//configurations differing only for the quality share the basis.
+			if(!fitted || fitted->type != config.type || fitted->colorspace != config.colorspace ||
+					fitted->nplanes != config.nplanes || fitted->yccplanes != config.yccplanes) {
+				setConfiguration(config);
+				fitSamples(raw);
+				fitted = &config;
+			}
+			evaluateConfiguration(probe, probe_rows, config);
+		}
+
+		for(SweepConfig &a: sweeps) {
+			a.pareto = true;
+			for(SweepConfig &b: sweeps) {
+				if(b.size <= a.size && b.psnr >= a.psnr && (b.size < a.size || b.psnr > a.psnr)) {
+					a.pareto = false;
+					break;
+				}
+			}
+		}
+		if(sweep_psnr <= 0)
+			return true;
+
+		//smallest reaching the psnr, or the best one.
+		SweepConfig *chosen = nullptr;
+		for(SweepConfig &c: sweeps)
+			if(c.psnr >= sweep_psnr && (!chosen || c.size < chosen->size))
+				chosen = &c;
+		if(!chosen) {
+			for(SweepConfig &c: sweeps)
+				if(!chosen || c.psnr > chosen->psnr)
+					chosen = &c;
+		}
+		setConfiguration(*chosen);
+		fitSamples(raw);
+		quality = chosen->quality;
+
+	} catch(std::string e) {
+		error = e;
+		return false;
+	} catch(...) {
+		error = "Could not create a base.";
+		return false;
+	}
+	return true;
+}
+
+void RtiBuilder::setConfiguration(SweepConfig &config) {
+	type = config.type;
+	colorspace = config.colorspace;
+	nplanes = config.nplanes;
+	yccplanes[0] = config.yccplanes;
+	if(colorspace == MYCC)
+		yccplanes[1] = yccplanes[2] = (nplanes - yccplanes[0])/2;
+
+	if(type == BILINEAR) {
+		ndimensions = resolution*resolution;
+		buildResampleMaps();
+	} else {
+		ndimensions = lights.size();
+	}
+	material.planes.clear();
+	materialbuilders.clear();
+	basis.clear();
+}
+
+void RtiBuilder::fitSamples(SampleArray &raw) {
+	SampleArray resample(sampleBits());
+	sampleRange(resample);
+	resample.resize(raw.npixels(), ndimensions);
+
+	bool pca = type == RBF || type == BILINEAR;
+	covariances.clear();
+	if(pca)
+		covariances.resize(std::max<size_t>(1, nworkers)*(colorspace == MYCC ? 3 : 1));
+
+	PixelArray resampled;
+	scanSamples(raw, [&](uint32_t start, PixelArray &pixels) {
+		resampled.resize(pixels.npixels(), ndimensions);
+		resamplePixels(pixels, resampled);
+		for(uint32_t i = 0; i < resampled.npixels(); i++)
+			resample.store(start + i, resampled[i]);
+		if(pca)
+			accumulateCovariance(resampled);
+	});
+	nsamples = resample.npixels();
+	reduceCovariances();
+
+	pickBases(resample);
+	minmaxMaterial(resample);
+	finalizeMaterial();
+}
+
+uint32_t RtiBuilder::readProbe(PixelArray &probe) {
+	uint32_t strip = std::min<uint32_t>(16, height);
+	size_t stripbytes = size_t(width)*strip*lights.size()*sizeof(Color3f);
+	uint32_t nstrips = std::max<size_t>(1, std::min<size_t>({ 8, (64<<20)/stripbytes, height/strip }));
+	probe.resize(size_t(nstrips)*strip*width, lights.size());
+	imageset.restart();
+	uint32_t next = 0;
+	for(uint32_t s = 0; s < nstrips; s++) {
+		uint32_t y = std::max(next, (height - strip)*(2*s + 1)/(2*nstrips));
+		imageset.skipRows(y - next);
+		PixelArray &band = imageset.readBand(strip);
+		size_t offset = size_t(s)*strip*width;
+		std::copy(band.rawdata(), band.rawdata() + size_t(band.npixels())*lights.size()*3, probe.rawdata() + offset*lights.size()*3);
+		for(uint32_t i = 0; i < band.npixels(); i++) {
+			probe[offset + i].x = band[i].x;
+			probe[offset + i].y = band[i].y;
+		}
+		next = y + strip;
+	}
+	return nstrips*strip;
+}
+
+void RtiBuilder::quantizeProbe(PixelArray &probe, vector<vector<uint8_t>> &line) {
+	uint32_t npixels = probe.npixels();
+	PixelArray resampled(npixels, ndimensions);
+	resamplePixels(probe, resampled);
+	vector<float> principals;
+	toPrincipal(resampled, principals, nworkers);
+
+	uint32_t njpegs = (nplanes-1)/3 + 1;
+	line.assign(njpegs, vector<uint8_t>(size_t(npixels)*3, 0));
+	quantizeLine(principals.data(), npixels, line);
+}
+
+double RtiBuilder::renderError(Rti &rti, PixelArray &probe, std::vector<double> *perlight) {
+	uint32_t npixels = probe.npixels();
+	double mse = 0.0;
+	if(perlight)
+		perlight->assign(lights.size(), 0.0);
+	vector<uint8_t> rendered(size_t(npixels)*3);
+	for(size_t l = 0; l < lights.size(); l++) {
+		rti.render(lights[l][0], lights[l][1], rendered.data());
+		double e = 0.0;
+		for(uint32_t i = 0; i < npixels; i++) {
+			Color3f &original = probe[i][l];
+			for(int c = 0; c < 3; c++) {
+				double d = std::min(255.0f, original[c]) - rendered[i*3 + c];
+				e += d*d;
+			}
+		}
+		if(perlight)
+			(*perlight)[l] = e/(double(npixels)*3);
+		mse += e;
+	}
+	return mse/(double(npixels)*lights.size()*3);
+}
+
+void RtiBuilder::evaluateConfiguration(PixelArray &probe, uint32_t probe_rows, SweepConfig &config) {
+	exportMaterial();
+
+	uint32_t npixels = probe.npixels();
+	vector<vector<uint8_t>> line;
+	quantizeProbe(probe, line);
+	uint32_t njpegs = line.size();
+
+	//compressed and decoded as the viewer would.
+	Rti rti(*this);
+	rti.width = width;
+	rti.height = probe_rows;
+	rti.planes.assign(nplanes, vector<uint8_t>(npixels));
+	size_t bytes = 0;
+	vector<uint8_t> decoded;
+	for(uint32_t j = 0; j < njpegs; j++) {
+		bytes += compressProbe(line[j], probe_rows, j, config.quality, decoded);
+		for(uint32_t c = 0; c < 3 && j*3 + c < nplanes; c++)
+			for(uint32_t i = 0; i < npixels; i++)
+				rti.planes[j*3 + c][i] = decoded[i*3 + c];
+	}
+
+	double mse = renderError(rti, probe);
+	config.psnr = 20*log10(255.0) - 10*log10(std::max(mse, 1e-10));
+	config.size = bytes*height/probe_rows;
+}
+
+void RtiBuilder::allocateQualities(int quality) {
+	qualities.clear();
+	PixelArray probe;
+	uint32_t rows = readProbe(probe);
+	uint32_t npixels = probe.npixels();
+	vector<vector<uint8_t>> line;
+	quantizeProbe(probe, line);
+	uint32_t njpegs = line.size();
+
+	//error of the fit and quantization alone.
+	Rti rti(*this);
+	rti.width = width;
+	rti.height = rows;
+	rti.planes.assign(nplanes, vector<uint8_t>(npixels));
+	for(uint32_t p = 0; p < nplanes; p++)
+		for(uint32_t i = 0; i < npixels; i++)
+			rti.planes[p][i] = line[p/3][i*3 + p%3];
+	double base = renderError(rti, probe);
+
+	//squared error (over lights and channels) of a unit error on a plane, linearized on a few probe pixels.
+	uint32_t nunit = std::min<uint32_t>(64, npixels);
+	Rti unit(*this);
+	unit.width = nunit;
+	unit.height = 1;
+	unit.planes.assign(nplanes, vector<uint8_t>(nunit));
+	for(uint32_t p = 0; p < nplanes; p++)
+		for(uint32_t k = 0; k < nunit; k++)
+			unit.planes[p][k] = rti.planes[p][size_t(k)*npixels/nunit];
+
+	vector<vector<uint8_t>> reference(lights.size(), vector<uint8_t>(nunit*3));
+	for(size_t l = 0; l < lights.size(); l++)
+		unit.render(lights[l][0], lights[l][1], reference[l].data());
+
+	const int delta = 8;
+	vector<double> weight(nplanes, 0.0);
+	vector<uint8_t> rendered(nunit*3);
+	for(uint32_t p = 0; p < nplanes; p++) {
+		vector<uint8_t> original = unit.planes[p];
+		for(uint8_t &v: unit.planes[p])
+			v = v + delta <= 255 ? v + delta : v - delta;
+		for(size_t l = 0; l < lights.size(); l++) {
+			unit.render(lights[l][0], lights[l][1], rendered.data());
+			for(uint32_t k = 0; k < nunit*3; k++) {
+				double d = double(rendered[k]) - reference[l][k];
+				weight[p] += d*d;
+			}
+		}
+		weight[p] /= double(delta)*delta*nunit;
+		unit.planes[p] = original;
+	}
+
+	//size and added mse of each jpeg for decreasing qualities.
+	vector<int> ladder;
+	for(int q = quality; q >= 30; q -= 5)
+		ladder.push_back(q);
+	if(ladder.empty())
+		ladder.push_back(quality);
+	uint32_t nq = ladder.size();
+	vector<size_t> bytes(njpegs*nq);
+	vector<double> distortion(njpegs*nq, 0.0);
+	vector<uint8_t> decoded;
+	for(uint32_t j = 0; j < njpegs; j++) {
+		if(callback && !(*callback)("Allocating quality:", 100*j/njpegs))
+			throw std::string("Cancelled.");
+		for(uint32_t k = 0; k < nq; k++) {
+			bytes[j*nq + k] = compressProbe(line[j], rows, j, ladder[k], decoded);
+			for(uint32_t c = 0; c < 3 && j*3 + c < nplanes; c++) {
+				double e = 0.0;
+				for(uint32_t i = 0; i < npixels; i++) {
+					double d = double(decoded[i*3 + c]) - line[j][i*3 + c];
+					e += d*d;
+				}
+				distortion[j*nq + k] += weight[j*3 + c]*e/(double(npixels)*lights.size()*3);
+			}
+		}
+	}
+
+	//start at the highest quality, greedily lower the jpeg saving most bytes per added error within the budget.
+	double budget = 255.0*255.0/pow(10.0, rd_psnr/10.0) - base;
+	vector<uint32_t> chosen(njpegs, 0);
+	double total = 0.0;
+	for(uint32_t j = 0; j < njpegs; j++)
+		total += distortion[j*nq];
+	while(true) {
+		int best = -1;
+		double best_ratio = 0.0;
+		for(uint32_t j = 0; j < njpegs; j++) {
+			uint32_t k = chosen[j];
+			if(k + 1 >= nq)
+				continue;
+			double saved = double(bytes[j*nq + k]) - double(bytes[j*nq + k + 1]);
+			double added = distortion[j*nq + k + 1] - distortion[j*nq + k];
+			if(saved <= 0 || total + added > budget)
+				continue;
+			double ratio = added/saved;
+			if(best < 0 || ratio < best_ratio) {
+				best = j;
+				best_ratio = ratio;
+			}
+		}
+		if(best < 0)
+			break;
+		total += distortion[best*nq + chosen[best] + 1] - distortion[best*nq + chosen[best]];
+		chosen[best]++;
+	}
+	for(uint32_t j = 0; j < njpegs; j++)
+		qualities.push_back(ladder[chosen[j]]);
+}
+
+void RtiBuilder::estimateHeldout(SampleArray &heldout) {
+	heldout_mse.assign(lights.size(), 0.0);
+	heldout_psnr = 0.0;
+	if(heldout.npixels() == 0)
+		return;
+	exportMaterial();
+
+	//the held out samples are quantized and rendered as a 1 row image (a chunk at a time).
+	vector<double> mse;
+	vector<vector<uint8_t>> line;
+	Rti rti(*this);
+	rti.height = 1;
+	rti.planes.resize(nplanes);
+	scanSamples(heldout, [&](uint32_t /*start*/, PixelArray &pixels) {
+		uint32_t npixels = pixels.npixels();
+		quantizeProbe(pixels, line);
+		rti.width = npixels;
+		for(uint32_t p = 0; p < nplanes; p++) {
+			rti.planes[p].resize(npixels);
+			for(uint32_t i = 0; i < npixels; i++)
+				rti.planes[p][i] = line[p/3][i*3 + p%3];
+		}
+		renderError(rti, pixels, &mse);
+		for(size_t l = 0; l < lights.size(); l++)
+			heldout_mse[l] += mse[l]*npixels;
+	});
+	double total = 0.0;
+	for(double &e: heldout_mse) {
+		e /= heldout.npixels();
+		total += e;
+	}
+	total /= lights.size();
+	heldout_psnr = 20*log10(255.0) - 10*log10(std::max(total, 1e-10));
+}
+
+bool RtiBuilder::loadBasis(const std::string &filename) {
+	Rti reference;
+	if(!reference.load(filename.c_str(), false)) {
+		error = "Could not load the basis: " + reference.error;
+		return false;
+	}
+	bool pca = reference.type == RBF || reference.type == BILINEAR;
+	if(pca && reference.colorspace == MYCC) {
+		error = "MYCC bases can not be reused (only MRGB).";
+		return false;
+	}
+
+	//lights and quantized basis as saved (Rti::load dequantizes the basis and reads the lights only for RBF).
+	QFileInfo info(filename.c_str());
+	QDir dir = info.isDir() ? QDir(filename.c_str()) : info.dir();
+	QFile file(dir.filePath("info.json"));
+	if(!file.open(QFile::ReadOnly)) {
+		error = "Could not open the basis: " + dir.filePath("info.json").toStdString();
+		return false;
+	}
+	QJsonObject obj = QJsonDocument::fromJson(file.readAll()).object();
+
+	if(pca) {
+		//the basis is a function of the lights: same directions in the same order.
+		QJsonArray jlights = obj["lights"].toArray();
+		if(size_t(jlights.size()) != imageset.lights.size()*3) {
+			error = "The basis was built for a different number of lights.";
+			return false;
+		}
+		for(size_t i = 0; i < imageset.lights.size(); i++)
+			for(int k = 0; k < 3; k++)
+				if(fabs(jlights[int(i*3 + k)].toDouble() - imageset.lights[i][k]) > 1e-3) {
+					error = "The basis was built for different lights (light " + std::to_string(i) + ").";
+					return false;
+				}
+		if(reference.type == BILINEAR && (reference.resolution < 2 || reference.ndimensions != reference.resolution*reference.resolution)) {
+			error = "Invalid resolution of the bilinear basis.";
+			return false;
+		}
+		if(size_t(obj["basis"].toArray().size()) != size_t(reference.nplanes + 1)*reference.ndimensions*3) {
+			error = "The basis size does not match its planes and dimensions.";
+			return false;
+		}
+	}
+
+	type = reference.type;
+	colorspace = reference.colorspace;
+	nplanes = reference.nplanes;
+	for(int i = 0; i < 3; i++)
+		yccplanes[i] = reference.yccplanes[i];
+	sigma = reference.sigma;
+	if(type == BILINEAR)
+		resolution = reference.resolution;
+	material = reference.material;
+
+	if(pca) {
+		uint32_t dim = reference.ndimensions*3;
+		materialbuilder.mean.assign(reference.basis.begin(), reference.basis.begin() + dim);
+		materialbuilder.proj.assign(reference.basis.begin() + dim, reference.basis.end());
+
+		//save the same quantized basis of the reference (the outputs can be merged).
+		QJsonArray jbasis = obj["basis"].toArray();
+		basis.resize(jbasis.size());
+		for(int k = 0; k < jbasis.size(); k++)
+			basis[k] = jbasis[k].toInt();
+	}
+	return true;
+}
+
+int RtiBuilder::sampleBits() {
+	if(samplebits)
+		return samplebits;
+	//directional lights samples are the original 8 bit values, resampling, intensity compensation and ycc need more.
+	if(type != BILINEAR && !imageset.light3d && colorspace != MYCC && !gammaFix)
+		return 8;
+	return 16;
+}
+
+void RtiBuilder::sampleRange(SampleArray &sample) {
+	sample.setRange(2.0f*255.0f*imageset.maxFalloff());
+}
+
+void RtiBuilder::scanSamples(SampleArray &sample, std::function<void(uint32_t start, PixelArray &pixels)> process) {
+	//samples are converted to float a chunk at a time.
+	const uint32_t chunk = 4096;
+	PixelArray pixels;
+	for(uint32_t start = 0; start < sample.npixels(); start += chunk) {
+		uint32_t count = std::min(chunk, sample.npixels() - start);
+		sample.load(start, count, pixels);
+		process(start, pixels);
+	}
+}
+
+void RtiBuilder::accumulateCovariance(PixelArray &resampled) {
+	typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Records;
+	typedef Eigen::Map<Records, 0, Eigen::Stride<Eigen::Dynamic, 3>> Component;
+
+	//MRGB records are the pixels: light0 rgb, light1 rgb...; MYCC records are one component of all the lights.
+	uint32_t ncov = colorspace == MYCC ? 3 : 1;
+	uint32_t nthreads = covariances.size()/ncov;
+	uint32_t dim = resampled.components()*3;
+	uint32_t chunk = (resampled.npixels() + nthreads - 1)/nthreads;
+#pragma omp parallel for num_threads(nthreads)
+	for(int t = 0; t < int(nthreads); t++) {
+		uint32_t start = t*chunk;
+		uint32_t end = std::min(resampled.npixels(), start + chunk);
+		if(start >= end)
+			continue;
+		float *data = resampled.rawdata() + size_t(start)*dim;
+		if(ncov == 1) {
+			covariances[t].accumulate(Eigen::Map<Records>(data, end - start, dim));
+		} else {
+			for(uint32_t c = 0; c < 3; c++)
+				covariances[t*3 + c].accumulate(Component(data + c, end - start, dim/3, Eigen::Stride<Eigen::Dynamic, 3>(dim, 3)));
+		}
+	}
+}
 
 //assumes pixel intensities are already fixed.
-MaterialBuilder RtiBuilder::pickBasePCA(PixelArray &sample) {
+//the mean and covariance have been accumulated while sampling.
+MaterialBuilder RtiBuilder::pickBasePCA(SampleArray &sample) {
 	
 	
 	//let's work pixel by pixel
@@ -222,37 +966,8 @@ MaterialBuilder RtiBuilder::pickBasePCA(PixelArray &sample) {
 	if(colorspace == MRGB) {
 		uint32_t dim = sample.components()*3;
 		
-		vector<double> record(dim);
-		
-		vector<double> means;
-		PCA pca(dim, nsamples);
-		means.resize(dim, 0.0);
-
-		//compute mean
-		for(Pixel &pixel: sample) {
-			for(uint32_t k = 0; k < sample.components(); k ++) {
-				Color3f &c = pixel[k];
-				means[k*3 + 0] += double(c.r);
-				means[k*3 + 1] += double(c.g);
-				means[k*3 + 2] += double(c.b);
-			}
-		}
-		for(double &d: means)
-			d /= nsamples;
-
-		if(callback && !(*callback)("Computing PCA:", 5))
-			throw std::string("Cancelled.");
-
-		for(uint32_t i = 0; i < sample.size(); i++) {
-			Pixel &pixel = sample[i];
-			for(uint32_t k = 0; k < sample.components(); k ++) {
-				Color3f c = pixel[k];
-				record[k*3 + 0] = (double(c.r) - means[k*3+0]);
-				record[k*3 + 1] = (double(c.g) - means[k*3+1]);
-				record[k*3 + 2] = (double(c.b) - means[k*3+2]);
-			}
-			pca.setRecord(i, record);
-		}
+		PCA &pca = covariances[0];
+		Eigen::VectorXd means = pca.mean();
 
 		if(callback && !(*callback)("Computing PCA:", 10))
 			throw std::string("Cancelled.");
@@ -275,36 +990,9 @@ MaterialBuilder RtiBuilder::pickBasePCA(PixelArray &sample) {
 	} else { //MYCC!
 		uint32_t dim = sample.components();
 		
-		vector<double> record(dim);
-		vector<double> means;
-		
 		for(int component = 0; component < 3; component++) {
-			std::vector<PCA *> pcas;
-			means.resize(dim, 0.0);
-			
-			PCA pca(dim, nsamples);
-			
-			//compute mean
-			for(Pixel &pixel: sample) {
-				for(uint32_t k = 0; k < sample.components(); k ++) {
-					Color3f &c = pixel[k];
-					means[k] += double(c[component]);
-				}
-			}
-			for(double &d: means)
-				d /= nsamples;
-			
-			
-			for(uint32_t i = 0; i < nsamples; i++) {
-				//TODO iterate over rawdata.
-				Pixel &pixel = sample[i];
-				for(uint32_t k = 0; k < sample.components(); k ++) {
-					Color3f &c = pixel[k];
-					record[k] = (c[component] - means[k]);
-				}
-				pca.setRecord(i, record);
-			}
-
+			PCA &pca = covariances[component];
+			Eigen::VectorXd means = pca.mean();
 			
 			pca.solve(yccplanes[component]);
 
@@ -454,7 +1142,7 @@ MaterialBuilder RtiBuilder::pickBaseHSH(std::vector<Vector3f> &lights, Rti::Type
 	return mat;
 }
 
-void RtiBuilder::pickBases(PixelArray &sample) {
+void RtiBuilder::pickBases(SampleArray &sample) {
 	//rbf can't 3d, bilinear just resample (and then single base)
 	if(!imageset.light3d) {
 		materialbuilder = pickBase(sample, imageset.lights);
@@ -478,12 +1166,10 @@ void RtiBuilder::pickBases(PixelArray &sample) {
 			}
 		}
 	}
-	minmaxMaterial(sample);
-	finalizeMaterial();
 }
 
 
-MaterialBuilder RtiBuilder::pickBase(PixelArray &sample, std::vector<Vector3f> &lights) {
+MaterialBuilder RtiBuilder::pickBase(SampleArray &sample, std::vector<Vector3f> &lights) {
 
 
 	vector<Vector3f> directions = lights;
@@ -517,28 +1203,31 @@ MaterialBuilder RtiBuilder::pickBase(PixelArray &sample, std::vector<Vector3f> &
 //PTM or HSH with bad light distribution can over (or under) estimate.
 //we cane work on the histogram.
 //actually we could also work in post production (it's the same!).
-void RtiBuilder::normalizeHistogram(PixelArray &sample, double percentile) {
+void RtiBuilder::normalizeHistogram(SampleArray &sample, double percentile) {
 	std::vector<int> histogram[3]; //goes from -1.0 to 2.0
 	double step = 0.05;
 	int side = (int) 1.0/step;
 	for(int i = 0; i < 3; i++)
 		histogram[i].resize(side*3, 0);
 
-	for(uint32_t i = 0; i < sample.npixels(); i++) {
-		if(callback && (i % 8000) == 0)
-			if(!(*callback)("Histogram normalization:", 100*i/sample.npixels()))
-				throw std::string("Cancelled.");
+	vector<float> principals;
+	scanSamples(sample, [&](uint32_t start, PixelArray &pixels) {
+		if(callback && !(*callback)("Histogram normalization:", 100*start/sample.npixels()))
+			throw std::string("Cancelled.");
 
-		vector<float> principal = toPrincipal(sample[i]);
+		toPrincipal(pixels, principals, nworkers);
 
-		//check for top light: [1, 0....0]
-		for(int c = 0; c < 3; c++) {
-			float value = 1.0f*principal[0]/255.0f;
-			int bin = (int)round((value/step)) + side;
-			bin = max(0, min( side*3-1, bin));
-			histogram[c][bin]++;
+		for(uint32_t i = 0; i < pixels.npixels(); i++) {
+			float *principal = principals.data() + i*nplanes;
+			//check for top light: [1, 0....0]
+			for(int c = 0; c < 3; c++) {
+				float value = 1.0f*principal[0]/255.0f;
+				int bin = (int)round((value/step)) + side;
+				bin = max(0, min( side*3-1, bin));
+				histogram[c][bin]++;
+			}
 		}
-	}
+	});
 	//find top percentile value
 	int tot[3] = { 0, 0, 0 };
 	int top = 0;
@@ -564,7 +1253,7 @@ void RtiBuilder::normalizeHistogram(PixelArray &sample, double percentile) {
 	}
 }
 
-void RtiBuilder::minmaxMaterial(PixelArray &sample) {
+void RtiBuilder::minmaxMaterial(SampleArray &sample) {
 	uint32_t dim = sample.components()*3;
 
 	//material.planes.clear();
@@ -595,22 +1284,27 @@ void RtiBuilder::minmaxMaterial(PixelArray &sample) {
 		normalizeHistogram(sample, 0.95);
 	}
 
-	//TODO workers to speed up this.
-	for(uint32_t i = 0; i < sample.npixels(); i++) {
-		if(callback && (i % 8000) == 0)
-			if(!(*callback)("Coefficients quantization:", 100*i/sample.npixels()))
-				throw std::string("Cancelled.");
-\
-		vector<float> principal = toPrincipal(sample[i]);
+	vector<float> principals;
+	scanSamples(sample, [&](uint32_t start, PixelArray &pixels) {
+		if(callback && !(*callback)("Coefficients quantization:", 100*start/sample.npixels()))
+			throw std::string("Cancelled.");
+
+		toPrincipal(pixels, principals, nworkers);
 
 		//find max and min of coefficients
-		for(uint32_t p = 0; p < nplanes; p++) {
-			Material::Plane &plane = material.planes[p];
-			plane.min = std::min(principal[p], plane.min);
-			plane.max = std::max(principal[p], plane.max);
+		for(uint32_t i = 0; i < pixels.npixels(); i++) {
+			float *principal = principals.data() + i*nplanes;
+			for(uint32_t p = 0; p < nplanes; p++) {
+				Material::Plane &plane = material.planes[p];
+				plane.min = std::min(principal[p], plane.min);
+				plane.max = std::max(principal[p], plane.max);
+			}
 		}
+	});
+	commonMinMaxMaterial();
+}
 
-	}
+void RtiBuilder::commonMinMaxMaterial() {
 	//compute common min max for 3 colors
 	if(commonMinMax && colorspace == RGB) {
 		auto &planes = material.planes;
@@ -653,62 +1347,68 @@ void RtiBuilder::finalizeMaterial() {
 }
 
 
-void RtiBuilder::estimateError(PixelArray &sample, std::vector<float> &weights) {
+void RtiBuilder::estimateError(SampleArray &sample, std::vector<float> &weights) {
 	weights.clear();
 	weights.resize(sample.npixels(), 0.0f);
 	uint32_t dim = sample.components()*3;
 	double e = 0.0;
 	double m = 0.0;
-	for(size_t i = 0; i < sample.npixels(); i++) {
-		MaterialBuilder &matb = materialbuilder;
-		Material &mat = material;
+	vector<float> principals;
+	scanSamples(sample, [&](uint32_t start, PixelArray &pixels) {
+		toPrincipal(pixels, principals, materialbuilder, nworkers);
+		for(uint32_t j = 0; j < pixels.npixels(); j++) {
+			uint32_t i = start + j;
+			Pixel pixel = pixels[j];
+			MaterialBuilder &matb = materialbuilder;
+			Material &mat = material;
 		
-		vector<float> principal = toPrincipal(sample[i], materialbuilder);
-		for(size_t p = 0; p < principal.size(); p++) {
-			Material::Plane &plane = mat.planes[p];
-			principal[p] = plane.quantize(principal[p]);
-			principal[p] = plane.dequantize(principal[p]);
-		}
-		
-		vector<float> variable(dim, 0.0f);
-		for(uint32_t k = 0; k < dim; k++)
-			variable[k] = matb.mean[k];
+			float *principal = principals.data() + j*nplanes;
+			for(size_t p = 0; p < nplanes; p++) {
+				Material::Plane &plane = mat.planes[p];
+				principal[p] = plane.quantize(principal[p]);
+				principal[p] = plane.dequantize(principal[p]);
+			}
 		
-		for(uint32_t p = 0; p < nplanes; p++) {
-			float *eigen = matb.proj.data() + p*dim;//colptr(k);
+			vector<float> variable(dim, 0.0f);
 			for(uint32_t k = 0; k < dim; k++)
-				variable[k] += principal[p]*eigen[k];
+				variable[k] = matb.mean[k];
+		
+			for(uint32_t p = 0; p < nplanes; p++) {
+				float *eigen = matb.proj.data() + p*dim;//colptr(k);
+				for(uint32_t k = 0; k < dim; k++)
+					variable[k] += principal[p]*eigen[k];
 			
-			/*for(int y = 0; y < resolution; y++) {
-				for(int x = 0; x < resolution; x++) {
-					int o = (x + y*resolution)*3;
-					variable[o + 0] += principal[p]*eigen[o+0];
-					variable[o + 1] += principal[p]*eigen[o+1];
-					variable[o + 2] += principal[p]*eigen[o+2];
-				}
-			}*/
-		}
-		float *s = (float *)sample[i].data();
-		double se = 0.0;
-		for(uint32_t k = 0; k < variable.size(); k++) {
-			double d = variable[k] - s[k];
-			se += d*d;
-		}
-		for(uint32_t k = 0; k < variable.size()/3; k++) {
-			//			float O = variable[k*3+0] + variable[k*3+1] + variable[k*3+2];
-			//			float S = s[k*3+0] + s[k*3+1] + s[k*3+2];
+				/*for(int y = 0; y < resolution; y++) {
+					for(int x = 0; x < resolution; x++) {
+						int o = (x + y*resolution)*3;
+						variable[o + 0] += principal[p]*eigen[o+0];
+						variable[o + 1] += principal[p]*eigen[o+1];
+						variable[o + 2] += principal[p]*eigen[o+2];
+					}
+				}*/
+			}
+			float *s = (float *)pixel.data();
+			double se = 0.0;
+			for(uint32_t k = 0; k < variable.size(); k++) {
+				double d = variable[k] - s[k];
+				se += d*d;
+			}
+			for(uint32_t k = 0; k < variable.size()/3; k++) {
+				//			float O = variable[k*3+0] + variable[k*3+1] + variable[k*3+2];
+				//			float S = s[k*3+0] + s[k*3+1] + s[k*3+2];
 			
-			float Or = (variable[k*3+1] - variable[k*3+0]);
-			float Ob = (variable[k*3+1] - variable[k*3+2]);
-			float Sr = (s[k*3+1] - s[k*3+0]);
-			float Sb = (s[k*3+1] - s[k*3+2]);
-			//weights[i] += pow(Sr, 2.0f);
-			weights[i] += pow(Or - Sr, 4.0f) + pow(Ob - Sb, 4.0f);
+				float Or = (variable[k*3+1] - variable[k*3+0]);
+				float Ob = (variable[k*3+1] - variable[k*3+2]);
+				float Sr = (s[k*3+1] - s[k*3+0]);
+				float Sb = (s[k*3+1] - s[k*3+2]);
+				//weights[i] += pow(Sr, 2.0f);
+				weights[i] += pow(Or - Sr, 4.0f) + pow(Ob - Sb, 4.0f);
+			}
+			e += se;
+			se = sqrt(se);
+			//weights[i] += se;
 		}
-		e += se;
-		se = sqrt(se);
-		//weights[i] += se;
-	}
+	});
 	//normalization of weights
 	
 	e = sqrt(e/(sample.size()*3));
@@ -737,7 +1437,7 @@ bool RtiBuilder::saveJSON(QDir &dir, int quality) {
 	info.open(QFile::WriteOnly);
 	QTextStream stream(&info);
 	stream << "{\n\"width\": " << width << ", \"height\": " << height << ",\n"
-		   << "\"format\": \"jpg\",\n";
+		   << "\"format\": \"" << (pyramid == DEEPZOOM ? "deepzoom" : pyramid == TARZOOM ? "tarzoom" : "jpg") << "\",\n";
 	if(pixelSize > 0)
 		stream << "\"pixelSizeInMM\": " << pixelSize << ",\n";
 	stream << "\"type\":\"";
@@ -783,6 +1483,12 @@ bool RtiBuilder::saveJSON(QDir &dir, int quality) {
 		stream << "\"nplanes\": " << nplanes << ",\n";
 	
 	stream << "\"quality\": " << quality << ",\n";
+	if(qualities.size()) {
+		stream << "\"qualities\": [";
+		for(size_t i = 0; i < qualities.size(); i++)
+			stream << (i ? ", " : "") << qualities[i];
+		stream << "],\n";
+	}
 	
 	if(type == RBF || type == BILINEAR) {
 		stream << "\"basis\": [\n";
@@ -828,7 +1534,7 @@ bool RtiBuilder::saveJSON(QDir &dir, int quality) {
 	return true;
 }
 
-Vector3f extractMean(Pixel &pixels, int n) {
+Vector3f extractMean(Pixel pixels, int n) {
 	double m[3] = { 0.0, 0.0, 0.0 };
 	for(int i = 0; i < n; i++) {
 		Color3f &c = pixels[i];
@@ -840,7 +1546,7 @@ Vector3f extractMean(Pixel &pixels, int n) {
 }
 
 
-Vector3f extractMedian(Pixel &pixels, int n) {
+Vector3f extractMedian(Pixel pixels, int n) {
 
 	Vector3f m;
 	std::vector<float> a(n);
@@ -924,59 +1630,212 @@ Vector3f RtiBuilder::getNormalThreeLights(vector<float> &pri) {
 class Worker {
 public:
 	RtiBuilder &b;
+	RtiBuilder::Pass pass = RtiBuilder::PROCESS;
 	vector<vector<uint8_t>> line;
 	vector<uchar> normals;
 	vector<uchar> means;
 	vector<uchar> medians;
-	PixelArray sample;
+	vector<float> principals;
+	vector<float> min, max; //of the coefficients of the band, when fitting.
+	PixelArray *sample = nullptr; //band in the imageset ring, not used when quantizing.
 	PixelArray resample;
+	uint32_t first_row = 0;
+	uint32_t rows = 0;
 	
 	Worker(RtiBuilder &_builder): b(_builder) {
 		uint32_t njpegs = (b.nplanes-1)/3 + 1;
 		line.resize(njpegs);
-		for(auto &p: line)
-			p.resize(b.width*3, 0);
-		normals.resize(b.width*3);
-		means.resize(b.width*3);
-		medians.resize(b.width*3);
-		sample.resize(b.width, b.lights.size());
-		resample.resize(b.width, b.ndimensions);
-
 		//setAutodelete(false);
 	}
 
-	void run() {
-		b.processLine(sample, resample, line, normals, means, medians);
-	}
-};
-
-size_t RtiBuilder::savePTM(const std::string &output) {
-	//.ptm format requires min/max to be 1 per r, g and b;
-	assert(commonMinMax == true);
+	uint32_t nrows() { return rows; }
 
-	//.ptm coeff order is x*x, y*y, x*y, x, y, 1
-	//while in relight it is: 1, x, y, xx, xy, yy,
-	int coeffRemap[6] = { 3, 5, 4, 1, 2, 0};
+	void run() {
+		size_t npixels = size_t(rows)*b.width;
+		if(pass == RtiBuilder::QUANTIZE) {
+			b.spilledPrincipals(first_row, rows, principals);
+		} else {
+			normals.resize(npixels*3);
+			means.resize(npixels*3);
+			medians.resize(npixels*3);
+			resample.resize(npixels, b.ndimensions);
 
+			b.processLine(*sample, resample, principals, normals, means, medians);
+		}
 
-	//update scale bias and range in Rti structure
-	scale.resize(nplanes);
-	bias.resize(nplanes);
+		if(pass == RtiBuilder::FIT) {
+			b.spillPrincipals(first_row, rows, principals);
+			min.assign(b.nplanes, 1e20f);
+			max.assign(b.nplanes, -1e20f);
+			for(size_t i = 0; i < npixels; i++) {
+				float *pri = principals.data() + i*b.nplanes;
+				for(uint32_t p = 0; p < b.nplanes; p++) {
+					min[p] = std::min(min[p], pri[p]);
+					max[p] = std::max(max[p], pri[p]);
+				}
+			}
+			return;
+		}
 
-	for(uint32_t p = 0; p < nplanes; p++) {
-		scale[p] = material.planes[p].scale;
-		bias[p]  = material.planes[p].bias;
+		for(auto &p: line)
+			p.resize(npixels*3, 0);
+		b.quantizeLine(principals.data(), npixels, line);
 	}
+};
 
-	FILE *file = fopen(output.c_str(), "wb");
-	if(!file) {
-		cerr << "Could not open file: " << output << endl;
-		return false;
-	}
+uint32_t RtiBuilder::bandRows() {
+	if(bandrows)
+		return bandrows;
+	//bound the memory of a band (the ring holds one per slot, a few more than the workers) for large images with many lights.
+	size_t rowbytes = size_t(width)*(lights.size() + ndimensions)*sizeof(Color3f);
+	size_t maxbytes = 64<<20;
+	return uint32_t(std::max<size_t>(1, std::min<size_t>(32, maxbytes/std::max<size_t>(1, rowbytes))));
+}
 
-	assert(this->type == RtiBuilder::PTM);
+bool RtiBuilder::processBands(std::function<void(Worker &worker, uint32_t row)> write, Pass pass, uint32_t write_threads) {
+	uint32_t nrows = bandRows();
+	uint32_t nbands = (height + nrows - 1)/nrows;
 
-	std::ostringstream stream;
+	//3 stages overlap: bands are decoded here, fitted by nworkers threads, written in order by one more thread.
+	//a slot (worker and band in the imageset ring) is reused once its band has been written.
+	uint32_t nslots = nworkers + 2;
+	imageset.ring_size = nslots;
+
+	vector<Worker *> workers(nslots);
+	for(size_t i = 0; i < nslots; i++)
+		workers[i] = new Worker(*this);
+	vector<QFuture<void>> fitted(nbands);
+	vector<QFuture<void>> written(nbands);
+
+	QThreadPool pool;
+	pool.setMaxThreadCount(std::max<int>(1, int(nworkers) - int(write_threads) + 1));
+	QThreadPool writer; //a single thread runs the writes in the order they are queued.
+	writer.setMaxThreadCount(1);
+
+	bool completed = true;
+	for(uint32_t b = 0; b < nbands; b++) {
+		if(callback && b > 0) {
+			bool keep_going = (*callback)("Saving:", 100*b/nbands);
+			if(!keep_going) {
+				cout << "TODO: clean up directory, we are already saving!" << endl;
+				completed = false;
+				break;
+			}
+		}
+		if(b >= nslots)
+			written[b - nslots].waitForFinished();
+
+		Worker *worker = workers[b % nslots];
+		worker->pass = pass;
+		worker->first_row = b*nrows;
+		if(pass == QUANTIZE) {
+			worker->rows = std::min(nrows, height - b*nrows);
+		} else {
+			worker->sample = &imageset.readBand(nrows);
+			worker->rows = worker->sample->npixels()/width;
+		}
+
+		fitted[b] = QtConcurrent::run(&pool, [worker](){ worker->run(); });
+		QFuture<void> *fit = &fitted[b];
+		written[b] = QtConcurrent::run(&writer, [fit, worker, &write]() {
+			fit->waitForFinished();
+			write(*worker, worker->first_row);
+		});
+	}
+	writer.waitForDone();
+	pool.waitForDone();
+	for(Worker *worker: workers)
+		delete worker;
+	return completed;
+}
+
+bool RtiBuilder::onePass() {
+	return onepass && basisfile.empty() && !histogram_fix && (type == PTM || type == HSH || type == SH || type == H);
+}
+
+bool RtiBuilder::spillCoefficients(std::function<void(Worker &worker, uint32_t first_row)> write) {
+	if(spilled) //already fitted (saving in more formats).
+		return true;
+
+	delete spill;
+	spill = new QTemporaryFile;
+	size_t size = size_t(width)*height*nplanes*sizeof(Eigen::half);
+	if(!spill->open() || !spill->resize(size)) {
+		error = "Could not create a temporary file for the coefficients.";
+		return false;
+	}
+	spilled = (Eigen::half *)spill->map(0, size);
+	if(!spilled) {
+		error = "Could not map the temporary file of the coefficients.";
+		return false;
+	}
+
+	material.planes.assign(nplanes, Material::Plane());
+	imageset.restart();
+	bool completed = processBands([&](Worker &worker, uint32_t first_row) {
+		for(uint32_t p = 0; p < nplanes; p++) {
+			Material::Plane &plane = material.planes[p];
+			plane.min = std::min(plane.min, worker.min[p]);
+			plane.max = std::max(plane.max, worker.max[p]);
+		}
+		if(write)
+			write(worker, first_row);
+	}, FIT);
+	if(!completed) {
+		error = "Cancelled.";
+		return false;
+	}
+	commonMinMaxMaterial();
+	finalizeMaterial();
+	return true;
+}
+
+void RtiBuilder::spillPrincipals(uint32_t row, uint32_t rows, std::vector<float> &principals) {
+	size_t n = size_t(rows)*width*nplanes;
+	Eigen::half *h = spilled + size_t(row)*width*nplanes;
+	for(size_t i = 0; i < n; i++)
+		h[i] = Eigen::half(principals[i]);
+}
+
+void RtiBuilder::spilledPrincipals(uint32_t row, uint32_t rows, std::vector<float> &principals) {
+	size_t n = size_t(rows)*width*nplanes;
+	principals.resize(n);
+	Eigen::half *h = spilled + size_t(row)*width*nplanes;
+	for(size_t i = 0; i < n; i++)
+		principals[i] = float(h[i]);
+}
+
+size_t RtiBuilder::savePTM(const std::string &output) {
+	//.ptm format requires min/max to be 1 per r, g and b;
+	assert(commonMinMax == true);
+
+	//.ptm coeff order is x*x, y*y, x*y, x, y, 1
+	//while in relight it is: 1, x, y, xx, xy, yy,
+	int coeffRemap[6] = { 3, 5, 4, 1, 2, 0};
+
+
+	Pass pass = onePass() ? QUANTIZE : PROCESS;
+	if(pass == QUANTIZE && !spillCoefficients())
+		return 0;
+
+	//update scale bias and range in Rti structure
+	scale.resize(nplanes);
+	bias.resize(nplanes);
+
+	for(uint32_t p = 0; p < nplanes; p++) {
+		scale[p] = material.planes[p].scale;
+		bias[p]  = material.planes[p].bias;
+	}
+
+	FILE *file = fopen(output.c_str(), "wb");
+	if(!file) {
+		cerr << "Could not open file: " << output << endl;
+		return false;
+	}
+
+	assert(this->type == RtiBuilder::PTM);
+
+	std::ostringstream stream;
 
 	stream << "PTM_1.2\n";
 	assert(colorspace == RGB || colorspace == LRGB);
@@ -1012,16 +1871,8 @@ size_t RtiBuilder::savePTM(const std::string &output) {
 	fwrite(stream.str().data(), 1, stream.str().size(), file);
 
 	//second reading.
-	imageset.restart();
-
-	vector<Worker *> workers(height, nullptr);
-	for(size_t i = 0; i < nworkers; i++) {
-		workers[i] = new Worker(*this);
-	}
-	vector<QFuture<void>> futures(height);
-
-	QThreadPool pool;
-	pool.setMaxThreadCount(nworkers);
+	if(pass == PROCESS)
+		imageset.restart();
 
 	vector<uint8_t> line(width*6);
 
@@ -1032,28 +1883,18 @@ size_t RtiBuilder::savePTM(const std::string &output) {
 	size_t component_size = width*height*6;
 	size_t line_size = width*6;
 
-	for(uint32_t y = 0; y < height + nworkers; y++) {
-		if(callback && y > 0) {
-			bool keep_going = (*callback)("Saving:", 100*(y)/(height + nworkers-1));
-			if(!keep_going) {
-				cout << "TODO: clean up directory, we are already saving!" << endl;
-				break;
-			}
-		}
-		if(y >= nworkers) {
-			futures[y - nworkers].waitForFinished();
-
-			Worker *doneworker = workers[y - nworkers];
-
-			uint32_t row = y - nworkers;
+	processBands([&](Worker &worker, uint32_t first_row) {
+		for(uint32_t r = 0; r < worker.nrows(); r++) {
+			uint32_t row = first_row + r;
+			size_t offset = r*width*3; //start of the row in the worker band
 			if(colorspace == RGB) {
 				//worker line is organized for jpeg saving (so plane 1, 2, 3 in line[0] as data rgbrgbrgb etc.
 				for(int c = 0; c < 3; c++) {
 					fseek(file, data_start + component_size*c + line_size*(height - row-1), SEEK_SET);
 
 					for(uint32_t x = 0; x < width; x++) {
-						for(uint32_t j = 0; j < doneworker->line.size(); j++) { //these are 6 rgb
-							line[x*6 + j] = doneworker->line[coeffRemap[j]][x*3 + c];
+						for(uint32_t j = 0; j < worker.line.size(); j++) { //these are 6 rgb
+							line[x*6 + j] = worker.line[coeffRemap[j]][offset + x*3 + c];
 						}
 					}
 					fwrite(line.data(), 1, line.size(), file);
@@ -1064,29 +1905,17 @@ size_t RtiBuilder::savePTM(const std::string &output) {
 						int k = coeffRemap[j];
 						int jpeg = 1+k/3;
 						int component = k%3;
-						line[x*6 + j] = doneworker->line[jpeg][x*3 + component];
+						line[x*6 + j] = worker.line[jpeg][offset + x*3 + component];
 					}
 				}
 				fseek(file, data_start + line_size*(height - row-1), SEEK_SET);
 				fwrite(line.data(), 1, width*6, file);
 
 				fseek(file, data_start + line_size*height + 3*width*(height - row-1), SEEK_SET);
-				fwrite(doneworker->line[0].data(), 1, width*3, file);
+				fwrite(worker.line[0].data() + offset, 1, width*3, file);
 			}
-			if(y < height)
-				workers[y] = doneworker;
-			else
-				delete doneworker;
 		}
-
-		if(y < height) {
-			Worker *worker = workers[y];
-			assert(worker != nullptr);
-			imageset.readLine(worker->sample);
-
-			futures[y] = QtConcurrent::run(&pool, [worker](){worker->run(); });
-		}
-	}
+	}, pass);
 	int64_t total = ftell(file);
 	fclose(file);
 	return total;
@@ -1098,6 +1927,10 @@ size_t RtiBuilder::saveUniversal(const std::string &output) {
 	//Universal .rti format requires min/max to be 1 per r, g and b;
 	assert(commonMinMax == true);
 
+	Pass pass = onePass() ? QUANTIZE : PROCESS;
+	if(pass == QUANTIZE && !spillCoefficients())
+		return 0;
+
 	//update scale bias and range in Rti structure
 	scale.resize(nplanes);
 	bias.resize(nplanes);
@@ -1136,55 +1969,25 @@ size_t RtiBuilder::saveUniversal(const std::string &output) {
 
 
 	//second reading.
-	imageset.restart();
-
-	vector<Worker *> workers(height, nullptr);
-	for(size_t i = 0; i < nworkers; i++) {
-		workers[i] = new Worker(*this);
-	}
-	vector<QFuture<void>> futures(height);
-
-	QThreadPool pool;
-	pool.setMaxThreadCount(nworkers);
+	if(pass == PROCESS)
+		imageset.restart();
 
 	vector<uint8_t> line(width*nplanes);
 
-	for(uint32_t y = 0; y < height + nworkers; y++) {
-		if(callback && y > 0) {
-			bool keep_going = (*callback)("Saving:", 100*(y)/(height + nworkers-1));
-			if(!keep_going) {
-				cout << "TODO: clean up directory, we are already saving!" << endl;
-				break;
-			}
-		}
-		if(y >= nworkers) {
-			futures[y - nworkers].waitForFinished();
-
-			Worker *doneworker = workers[y - nworkers];
-
+	processBands([&](Worker &worker, uint32_t /*first_row*/) {
+		for(uint32_t r = 0; r < worker.nrows(); r++) {
+			size_t offset = r*width*3; //start of the row in the worker band
 			//worker line is organized for jpeg saving (so plane 1, 2, 3 in line[0] as data rgbrgrg etc.
-			for(size_t j = 0; j < doneworker->line.size(); j++) {
+			for(size_t j = 0; j < worker.line.size(); j++) {
 				for(uint32_t x = 0; x < width; x++) {
-					line[x*nplanes + j + 0*nplanes/3] = doneworker->line[j][x*3+0];
-					line[x*nplanes + j + 1*nplanes/3] = doneworker->line[j][x*3+1];
-					line[x*nplanes + j + 2*nplanes/3] = doneworker->line[j][x*3+2];
+					line[x*nplanes + j + 0*nplanes/3] = worker.line[j][offset + x*3+0];
+					line[x*nplanes + j + 1*nplanes/3] = worker.line[j][offset + x*3+1];
+					line[x*nplanes + j + 2*nplanes/3] = worker.line[j][offset + x*3+2];
 				}
 			}
 			fwrite(line.data(), 1, line.size(), file);
-			if(y < height)
-				workers[y] = doneworker;
-			else
-				delete doneworker;
-		}
-
-		if(y < height) {
-			Worker *worker = workers[y];
-			assert(worker != nullptr);
-			imageset.readLine(worker->sample);
-
-			futures[y] = QtConcurrent::run(&pool, [worker](){worker->run(); });
 		}
-	}
+	}, pass);
 	int64_t total = ftell(file);
 	fclose(file);
 	return total;
@@ -1202,39 +2005,67 @@ size_t RtiBuilder::save(const string &output, int quality) {
 			return 0;
 		}
 	}
-	
-	//update scale bias and range in Rti structure
-	scale.resize(nplanes);
-	bias.resize(nplanes);
-	range.resize(nplanes);
-	
-	for(uint32_t p = 0; p < nplanes; p++) {
-		scale[p] = material.planes[p].scale;
-		bias[p]  = material.planes[p].bias;
-		if(colorspace == MRGB || colorspace == MYCC)
-			range[p] = material.planes[p].range;
-	}
-	
-	if(type == RBF || type == BILINEAR) {
-		
-		if(colorspace == MRGB || colorspace == MYCC) { //ycc should only store 1 component!
 
-			for(uint32_t p = 0; p < ndimensions*3; p++)
-				basis.push_back((int)(materialbuilder.mean[p]));
+	//TODO
+	QImage normals(width, height, QImage::Format_RGB32);
+	QImage means  (width, height, QImage::Format_RGB32);
+	QImage medians(width, height, QImage::Format_RGB32);
 
+	// Set spatial resolution if known. Convert to pixels/m as RtiBuilder stores this in mm/pixel
+	if (pixelSize > 0) {
+	        int dotsPerMeter = round(1000.0/pixelSize);
+		normals.setDotsPerMeterX(dotsPerMeter);
+		normals.setDotsPerMeterY(dotsPerMeter);
+		means.setDotsPerMeterX(dotsPerMeter);
+		means.setDotsPerMeterY(dotsPerMeter);
+		medians.setDotsPerMeterX(dotsPerMeter);
+		medians.setDotsPerMeterY(dotsPerMeter);
+	}
 
+	//colorspace check
+	if (savenormals) {
+		//init matrix for light computation (bleargh, static in function)
+		vector<float> dummy(nplanes, 0.0f);
+		getNormalThreeLights(dummy);
+		if (colorspace != RGB && colorspace != MRGB) {
+			cerr << "NO NORMALS (unsupported colorspace: RGB and MRGB only supported!)" << endl;
+			savenormals = false;
+		}
+	}
 
-			for(uint32_t p = 0; p < nplanes; p++) {
-				Material::Plane &plane = material.planes[p];
-				float *eigen = materialbuilder.proj.data() + p*dim;
-				for(uint32_t k = 0; k < ndimensions*3; k++) {
-					basis.push_back((int)(127 + plane.range*eigen[k]));
-				}
+	//normals, means and medians need the original pixels: they come from the bands being fitted.
+	auto extract = [&](Worker &worker, uint32_t first_row) {
+		for(uint32_t r = 0; r < worker.nrows(); r++) {
+			uint32_t y = first_row + r;
+			size_t offset = r*width*3; //start of the row in the worker band
+			for(uint32_t x = 0; x < width; x++) {
+				size_t o = offset + x*3;
+				if (savenormals)
+					normals.setPixel(x, y, qRgb(worker.normals[o], worker.normals[o+1], worker.normals[o+2]));
+				if(savemeans)
+					means.setPixel(x, y, qRgb(worker.means[o], worker.means[o+1], worker.means[o+2]));
+				if(savemedians)
+					medians.setPixel(x, y, qRgb(worker.medians[o], worker.medians[o+1], worker.medians[o+2]));
 			}
 		}
+	};
+
+	//onepass: quantization is known only after all the pixels are fitted, the coefficients are spilled meanwhile.
+	Pass pass = onePass() ? QUANTIZE : PROCESS;
+	if(pass == QUANTIZE && !spillCoefficients(extract))
+		return 0;
+
+	exportMaterial();
+	qualities.clear();
+	if(rd_psnr > 0) {
+		try {
+			allocateQualities(quality);
+		} catch(std::string e) {
+			error = e;
+			return 0;
+		}
 	}
 
-	
 	//TODO error control
 	bool ok = saveJSON(dir, quality);
 	if(!ok) return 0;
@@ -1313,116 +2144,66 @@ size_t RtiBuilder::save(const string &output, int quality) {
 	for(auto &p: line)
 		p.resize(width*3, 0);
 	
-	vector<JpegEncoder *> encoders(njpegs);
-	
-	for(uint32_t i = 0; i < encoders.size(); i++) {
-		encoders[i] = new JpegEncoder();
-		encoders[i]->setQuality(quality);
-		encoders[i]->setColorSpace(JCS_RGB, 3);
-		encoders[i]->setJpegColorSpace(JCS_YCbCr);
-
-		// Set spatial resolution if known. Convert to pixels/m as RtiBuilder stores this in mm/pixel
-		if(pixelSize > 0) encoders[i]->setDotsPerMeter(1000.0/pixelSize);
+	//thread budget (nworkers): up to half compress, the rest fit the bands.
+	//the jpegs are compressed in parallel, or one at a time split in stripes if jpeg_threads > 1 (never both).
+	int compress_threads = std::min<int>(njpegs, std::max<int>(1, nworkers/2));
+	int stripe_threads = 1;
+	if(jpeg_threads > 1 && pyramid == NOPYRAMID) {
+		stripe_threads = std::min<int>(jpeg_threads, std::max<int>(1, nworkers/2));
+		compress_threads = 1;
+	}
 
-		if(!chromasubsampling)
-			encoders[i]->setChromaSubsampling(false);
-		
-		else {
-			if(colorspace == MRGB)
-				encoders[i]->setChromaSubsampling(false);
-			
-			else if(colorspace == YCC) {
-				encoders[i]->setChromaSubsampling(i < yccplanes[0]);
-				
-			} else {
-				encoders[i]->setChromaSubsampling(true);
+	vector<JpegEncoder *> encoders;
+	vector<DeepZoom *> zooms; //tiles straight from the quantized rows, no plane jpegs.
+	
+	for(uint32_t i = 0; i < njpegs; i++) {
+		int q = i < qualities.size() ? qualities[i] : quality;
+		if(pyramid != NOPYRAMID) {
+			DeepZoom *zoom = new DeepZoom;
+			zoom->quality = tilequality ? tilequality : q;
+			zoom->tarzoom = pyramid == TARZOOM;
+			if(!zoom->init(dir.filePath("plane_%1").arg(i), width, height, tilesize, tileoverlap)) {
+				error = "Could not create the tiles folder.";
+				delete zoom;
+				for(DeepZoom *z: zooms)
+					delete z;
+				return 0;
 			}
+			zooms.push_back(zoom);
+			continue;
 		}
-		
-		encoders[i]->init(dir.filePath("plane_%1.jpg").arg(i).toStdString().c_str(), width, height);
+		JpegEncoder *encoder = new JpegEncoder();
+		setupEncoder(encoder, i, q);
+		encoder->setThreads(stripe_threads);
+		encoder->init(dir.filePath("plane_%1.jpg").arg(i).toStdString().c_str(), width, height);
+		encoders.push_back(encoder);
 	}
 
 	//second reading.
-	imageset.restart();
-
-	//TODO
-	QImage normals(width, height, QImage::Format_RGB32);
-	QImage means  (width, height, QImage::Format_RGB32);
-	QImage medians(width, height, QImage::Format_RGB32);
-
-	// Set spatial resolution if known. Convert to pixels/m as RtiBuilder stores this in mm/pixel
-	if (pixelSize > 0) {
-	        int dotsPerMeter = round(1000.0/pixelSize);
-		normals.setDotsPerMeterX(dotsPerMeter);
-		normals.setDotsPerMeterY(dotsPerMeter);
-		means.setDotsPerMeterX(dotsPerMeter);
-		means.setDotsPerMeterY(dotsPerMeter);
-		medians.setDotsPerMeterX(dotsPerMeter);
-		medians.setDotsPerMeterY(dotsPerMeter);
-	}
-
-	//colorspace check
-	if (savenormals) {
-		//init matrix for light computation (bleargh, static in function)
-		vector<float> dummy(nplanes, 0.0f);
-		getNormalThreeLights(dummy);
-		if (colorspace != RGB && colorspace != MRGB) {
-			cerr << "NO NORMALS (unsupported colorspace: RGB and MRGB only supported!)" << endl;
-			savenormals = false;
-		}
-	}
-
-	vector<Worker *> workers(height, nullptr);
-	for(size_t i = 0; i < nworkers; i++) {
-		workers[i] = new Worker(*this);
-	}
-	vector<QFuture<void>> futures(height);
-
-	QThreadPool pool;
-	pool.setMaxThreadCount(nworkers);
-
-	for(uint32_t y = 0; y < height + nworkers; y++) {
-		if(callback && y > 0) {
-			bool keep_going = (*callback)("Saving:", 100*(y)/(height + nworkers-1));
-			if(!keep_going) {
-				cout << "TODO: clean up directory, we are already saving!" << endl;
-				break;
-			}
-		}
-		if(y >= nworkers) {
-			futures[y - nworkers].waitForFinished();
-
-			Worker *doneworker = workers[y - nworkers];
-
-			for(uint32_t x = 0; x < width; x++) {
-				if (savenormals)
-					normals.setPixel(x, y- nworkers, qRgb(doneworker->normals[x*3], doneworker->normals[x*3+1], doneworker->normals[x*3+2]));
-				if(savemeans)
-					means.setPixel(x, y- nworkers, qRgb(doneworker->means[x*3], doneworker->means[x*3+1], doneworker->means[x*3+2]));
-				if(savemedians)
-					medians.setPixel(x, y- nworkers, qRgb(doneworker->medians[x*3], doneworker->medians[x*3+1], doneworker->medians[x*3+2]));
-			}
-			for(size_t j = 0; j < encoders.size(); j++)
-				encoders[j]->writeRows(doneworker->line[j].data(), 1);
-			if(y < height)
-				workers[y] = doneworker;
+	if(pass == PROCESS)
+		imageset.restart();
+
+	processBands([&](Worker &worker, uint32_t first_row) {
+		if(pass == PROCESS)
+			extract(worker, first_row);
+#pragma omp parallel for num_threads(compress_threads)
+		for(int j = 0; j < int(njpegs); j++) {
+			if(zooms.size())
+				zooms[j]->addRows(worker.line[j].data(), worker.nrows());
 			else
-				delete doneworker;
+				encoders[j]->writeRows(worker.line[j].data(), worker.nrows());
 		}
-
-		if(y < height) {
-			Worker *worker = workers[y];
-			assert(worker != nullptr);
-			imageset.readLine(worker->sample);
-
-			futures[y] = QtConcurrent::run(&pool, [worker](){worker->run(); });
-		}
-	}
+	}, pass, std::max(compress_threads, stripe_threads));
 
 	size_t total = 0;
 	for(size_t p = 0; p < encoders.size(); p++) {
 		size_t s = encoders[p]->finish();
 		total += s;
+		delete encoders[p];
+	}
+	for(size_t p = 0; p < zooms.size(); p++) {
+		total += zooms[p]->finish();
+		delete zooms[p];
 	}
 
 	if(savenormals)
@@ -1440,18 +2221,79 @@ size_t RtiBuilder::save(const string &output, int quality) {
 	return total;
 }
 
-void RtiBuilder::processLine(PixelArray &sample, PixelArray &resample, std::vector<std::vector<uint8_t>> &line,
+void RtiBuilder::exportMaterial() {
+	uint32_t dim = ndimensions*3;
+
+	//update scale bias and range in Rti structure
+	scale.resize(nplanes);
+	bias.resize(nplanes);
+	range.resize(nplanes);
+	
+	for(uint32_t p = 0; p < nplanes; p++) {
+		scale[p] = material.planes[p].scale;
+		bias[p]  = material.planes[p].bias;
+		if(colorspace == MRGB || colorspace == MYCC)
+			range[p] = material.planes[p].range;
+	}
+	
+	if(type == RBF || type == BILINEAR) {
+		
+		//already set when the basis is loaded.
+		if(basis.empty() && (colorspace == MRGB || colorspace == MYCC)) { //ycc should only store 1 component!
+
+			for(uint32_t p = 0; p < ndimensions*3; p++)
+				basis.push_back((int)(materialbuilder.mean[p]));
+
+
+
+			for(uint32_t p = 0; p < nplanes; p++) {
+				Material::Plane &plane = material.planes[p];
+				float *eigen = materialbuilder.proj.data() + p*dim;
+				for(uint32_t k = 0; k < ndimensions*3; k++) {
+					basis.push_back((int)(127 + plane.range*eigen[k]));
+				}
+			}
+		}
+	}
+}
+
+void RtiBuilder::setupEncoder(JpegEncoder *encoder, uint32_t i, int quality) {
+	encoder->setQuality(quality);
+	encoder->setThreads(jpeg_threads);
+	encoder->setColorSpace(JCS_RGB, 3);
+	encoder->setJpegColorSpace(JCS_YCbCr);
+
+	// Set spatial resolution if known. Convert to pixels/m as RtiBuilder stores this in mm/pixel
+	if(pixelSize > 0) encoder->setDotsPerMeter(1000.0/pixelSize);
+
+	if(!chromasubsampling)
+		encoder->setChromaSubsampling(false);
+
+	else {
+		if(colorspace == MRGB)
+			encoder->setChromaSubsampling(false);
+
+		else if(colorspace == YCC) {
+			encoder->setChromaSubsampling(i < yccplanes[0]);
+
+		} else {
+			encoder->setChromaSubsampling(true);
+		}
+	}
+}
+
+void RtiBuilder::processLine(PixelArray &sample, PixelArray &resample, std::vector<float> &principals,
 							 std::vector<uchar> &normals, std::vector<uchar> &means, std::vector<uchar> &medians) {
 
-	for(uint32_t x = 0; x < width; x++)
-		resamplePixel(sample[x], resample[x]);
+	uint32_t npixels = sample.npixels();
+	resamplePixels(sample, resample);
 
 
 	if (savenormals) {
 		Eigen::MatrixXf A(sample.nlights, 1);
 		Eigen::MatrixXf b(sample.nlights, 3);
 
-		for(uint32_t x = 0; x < width; x++) {
+		for(uint32_t x = 0; x < npixels; x++) {
 			for(uint32_t y = 0; y < sample.nlights; y++)
 				A(y, 0) = sample[x][y].mean();
 
@@ -1470,9 +2312,9 @@ void RtiBuilder::processLine(PixelArray &sample, PixelArray &resample, std::vect
 	}
 
 
-	for(uint32_t x = 0; x < width; x++) {
-		vector<float> pri = toPrincipal(resample[x]);
+	toPrincipal(resample, principals);
 
+	for(uint32_t x = 0; x < npixels; x++) {
 		if(savemeans) {
 			Vector3f n = extractMean(sample[x], lights.size());
 			means[x*3+0] = n[0];
@@ -1486,24 +2328,47 @@ void RtiBuilder::processLine(PixelArray &sample, PixelArray &resample, std::vect
 			medians[x*3+1] = n[1];
 			medians[x*3+2] = n[2];
 		}
+	}
+}
 
-		if(colorspace == LRGB){
-			for(uint32_t j = 0; j < nplanes/3; j++) {
-				for(uint32_t c = 0; c < 3; c++) {
-					uint32_t p = j*3 + c;
-					if(j >= 1)
-						pri[p] = material.planes[p].quantize(pri[p]);
-					line[j][x*3 + c] = pri[p];
-				}
-			}
+void RtiBuilder::quantizeLine(float *principals, uint32_t npixels, std::vector<std::vector<uint8_t>> &line) {
+	//same operations as Plane::quantize (in double, truncated then clamped), the LRGB base color is stored as it is.
+	const uint32_t block = 64;
+	uint32_t n = block*nplanes;
+	std::vector<double> scales(n), biases(n);
+	std::vector<uint8_t> raw(n);
+	for(uint32_t p = 0; p < nplanes; p++) {
+		Material::Plane &plane = material.planes[p];
+		for(uint32_t x = 0; x < block; x++) {
+			scales[x*nplanes + p] = plane.scale;
+			biases[x*nplanes + p] = plane.bias;
+			raw[x*nplanes + p] = colorspace == LRGB && p < 3;
+		}
+	}
 
-		} else {
+	//blocks of pixels are quantized in a single (vectorized) loop, then split in the rgb rows of each plane triplet.
+	std::vector<uint8_t> q(n);
+	uint32_t njpegs = (nplanes-1)/3 + 1;
+	for(uint32_t start = 0; start < npixels; start += block) {
+		uint32_t count = std::min(block, npixels - start);
+		const float *pri = principals + size_t(start)*nplanes;
+		uint32_t m = count*nplanes;
+#pragma omp simd
+		for(uint32_t i = 0; i < m; i++) {
+			double value = pri[i];
+			int v = raw[i] ? (int)value : (int)(255*(value/255.0/scales[i] + biases[i]));
+			q[i] = uint8_t(std::max(0, std::min(255, v)));
+		}
 
-			for(uint32_t j = 0; j < nplanes/3; j++) {
-				for(uint32_t c = 0; c < 3; c++) {
-					uint32_t p = j*3 + c;
-					line[j][x*3 + c] = material.planes[p].quantize(pri[p]);
-				}
+		//the last triplet might be incomplete: missing planes are 0.
+		for(uint32_t j = 0; j < njpegs; j++) {
+			uint32_t c = std::min<uint32_t>(3, nplanes - j*3);
+			uint8_t *dst = line[j].data() + size_t(start)*3;
+			const uint8_t *src = q.data() + j*3;
+			for(uint32_t x = 0; x < count; x++, dst += 3, src += nplanes) {
+				dst[0] = src[0];
+				dst[1] = c > 1 ? src[1] : 0;
+				dst[2] = c > 2 ? src[2] : 0;
 			}
 		}
 	}
@@ -1587,72 +2452,122 @@ PixelArray RtiBuilder::resamplePixels(PixelArray &sample) {
 	return pixels;
 }*/
 
-void RtiBuilder::remapPixel(Pixel  &sample, Pixel &pixel, Resamplemap &resamplemap, float weight) {
-	if(weight == 0) return;
-	for(uint32_t i = 0; i < ndimensions; i++) {
-		for(auto &w: resamplemap[i]) {
-			pixel[i].r += sample[w.first].r*w.second * weight;
-			pixel[i].g += sample[w.first].g*w.second * weight;
-			pixel[i].b += sample[w.first].b*w.second * weight;
+void RtiBuilder::remapPixels(PixelArray &sample, PixelArray &resample, uint32_t start, uint32_t end, Resamplemap &remap, const float *weights) {
+	//the lights of a pixel stay in cache while all the directions are resampled.
+	for(uint32_t x = start; x < end; x++) {
+		const Color3f *in = sample[x].data();
+		Color3f *out = resample[x].data();
+		float weight = weights ? weights[x - start] : 1.0f;
+		for(uint32_t i = 0; i < ndimensions; i++) {
+			float r = 0.0f, g = 0.0f, b = 0.0f;
+			for(uint32_t k = remap.rows[i]; k < remap.rows[i+1]; k++) {
+				const Color3f &c = in[remap.cols[k]];
+				float w = remap.weights[k];
+				r += c.r*w;
+				g += c.g*w;
+				b += c.b*w;
+			}
+			out[i].r += r*weight;
+			out[i].g += g*weight;
+			out[i].b += b*weight;
+		}
+	}
+}
+
+//a*wa + b*wb, cols are sorted in each row of both.
+static void blendResamplemaps(const Resamplemap &a, float wa, const Resamplemap &b, float wb, Resamplemap &out) {
+	size_t nrows = a.rows.size() - 1;
+	out.rows.assign(1, 0);
+	out.cols.clear();
+	out.weights.clear();
+	for(size_t i = 0; i < nrows; i++) {
+		uint32_t ka = a.rows[i], kb = b.rows[i];
+		while(ka < a.rows[i+1] || kb < b.rows[i+1]) {
+			uint32_t ca = ka < a.rows[i+1] ? a.cols[ka] : UINT32_MAX;
+			uint32_t cb = kb < b.rows[i+1] ? b.cols[kb] : UINT32_MAX;
+			uint32_t c = std::min(ca, cb);
+			float w = 0.0f;
+			if(ca == c)
+				w += wa*a.weights[ka++];
+			if(cb == c)
+				w += wb*b.weights[kb++];
+			out.cols.push_back(c);
+			out.weights.push_back(w);
 		}
+		out.rows.push_back(out.cols.size());
 	}
 }
 
-void RtiBuilder::resamplePixel(Pixel &sample, Pixel &pixel) { //pos in pixels.
+void RtiBuilder::resamplePixels(PixelArray &sample, PixelArray &resample) {
+	uint32_t npixels = sample.npixels();
+	for(uint32_t x = 0; x < npixels; x++) {
+		resample[x].x = sample[x].x;
+		resample[x].y = sample[x].y;
+	}
 
-	pixel.x = sample.x;
-	pixel.y = sample.y;
 	if(type == BILINEAR) {
-		if(imageset.light3d) {
-			//TODO move this somewhere else
-			float X = (resample_width-1)*sample.x/float(imageset.image_width);
-			float Y = (resample_height-1)*sample.y/float(imageset.image_height);
-
-			for(uint32_t i = 0; i < ndimensions; i++)
-				pixel[i].r = pixel[i].g = pixel[i].b = 0.0f;
-
-			//find 4 resamplemaps and coefficients
-			float ix, iy;
-			float dx = modff(X, &ix);
-			float dy = modff(Y, &iy);
-			Resamplemap &A = resamplemaps[int(ix) + int(iy)*resample_width];
-			float wA = (1 - dx)*(1 - dy);
-			remapPixel(sample, pixel, A, wA);
-
-			Resamplemap &B = resamplemaps[int(ix+1) + int(iy)*resample_width];
-			float wB = dx*(1 - dy);
-			remapPixel(sample, pixel, B, wB);
-
-			Resamplemap &C = resamplemaps[int(ix) + int(iy+1)*resample_width];
-			float wC = (1 - dx)*dy;
-			remapPixel(sample, pixel, C, wC);
-
-			Resamplemap &D = resamplemaps[int(ix+1) + int(iy+1)*resample_width];
-			float wD = dx*dy;
-			remapPixel(sample, pixel, D, wD);
+		std::fill(resample.rawdata(), resample.rawdata() + size_t(npixels)*ndimensions*3, 0.0f);
 
-		} else {
+		if(!imageset.light3d) {
+			remapPixels(sample, resample, 0, npixels, resamplemap);
 
-			for(uint32_t i = 0; i < ndimensions; i++) {
-				pixel[i].r = pixel[i].g = pixel[i].b = 0.0f;
-				for(auto &w: resamplemap[i]) {
-					pixel[i].r += sample[w.first].r*w.second;
-					pixel[i].g += sample[w.first].g*w.second;
-					pixel[i].b += sample[w.first].b*w.second;
+		} else {
+			//the 4 maps around a pixel: the 2 rows of the grid are blended once per pixel row (for each column of the grid),
+			//each run of pixels in the same cell is resampled with the 2 blended maps weighted horizontally.
+			auto column = [&](int x, float &dx) {
+				float X;
+				dx = modff((resample_width-1)*x/float(imageset.image_width), &X);
+				return int(X);
+			};
+
+			std::vector<Resamplemap> row(resample_width);
+			std::vector<int> row_y(resample_width, -1);
+			auto blended = [&](int X, int y) -> Resamplemap & {
+				if(row_y[X] != y) {
+					row_y[X] = y;
+					float Y;
+					float dy = modff((resample_height-1)*y/float(imageset.image_height), &Y);
+					blendResamplemaps(resamplemaps[X + int(Y)*resample_width], 1 - dy,
+									  resamplemaps[X + int(Y+1)*resample_width], dy, row[X]);
+				}
+				return row[X];
+			};
+
+			std::vector<float> wleft, wright;
+			for(uint32_t start = 0; start < npixels; ) {
+				float dx;
+				int y = sample[start].y;
+				int X = column(sample[start].x, dx);
+				wleft.clear();
+				wright.clear();
+				uint32_t end = start;
+				while(end < npixels && sample[end].y == y && column(sample[end].x, dx) == X) {
+					wleft.push_back(1 - dx);
+					wright.push_back(dx);
+					end++;
 				}
+				remapPixels(sample, resample, start, end, blended(X, y), wleft.data());
+				remapPixels(sample, resample, start, end, blended(X + 1, y), wright.data());
+				start = end;
 			}
 		}
 
 	} else { //NOT BILINEAR
-		for(uint32_t i = 0; i < ndimensions; i++)
-			pixel[i] = sample[i];
+		for(uint32_t x = 0; x < npixels; x++) {
+			Color3f *colors = sample[x].data();
+			std::copy(colors, colors + ndimensions, resample[x].data());
+		}
 	}
 
-	for(uint32_t i = 0; i < ndimensions; i++) {
-		if(colorspace == MYCC)
-			pixel[i] = pixel[i].toYcc();
-		else {
-			if(gammaFix) {
+	if(colorspace != MYCC && !gammaFix)
+		return;
+
+	for(uint32_t x = 0; x < npixels; x++) {
+		Pixel pixel = resample[x];
+		for(uint32_t i = 0; i < ndimensions; i++) {
+			if(colorspace == MYCC)
+				pixel[i] = pixel[i].toYcc();
+			else {
 				pixel[i].r = sqrt(pixel[i].r)*sqrt(255.0f);
 				pixel[i].g = sqrt(pixel[i].g)*sqrt(255.0f);
 				pixel[i].b = sqrt(pixel[i].b)*sqrt(255.0f);
@@ -1696,7 +2611,7 @@ void RtiBuilder::buildResampleMaps() {
 }
 
 
-void RtiBuilder::buildResampleMap(std::vector<Vector3f> &lights, std::vector<std::vector<std::pair<int, float>>> &remap) {
+void RtiBuilder::buildResampleMap(std::vector<Vector3f> &lights, Resamplemap &remap) {
 	/* every light is linear combination of 4 nearby points (x)
 	b = w00x00 + w01x01
 	solution is closed form matrix
@@ -1727,7 +2642,7 @@ void RtiBuilder::buildResampleMap(std::vector<Vector3f> &lights, std::vector<std
 	float radius = 1/(sigma*sigma);
 	Eigen::MatrixXd B = Eigen::MatrixXd::Zero(ndimensions, lights.size());
 
-	remap.resize(ndimensions);
+	std::vector<std::vector<std::pair<int, float>>> rbf(ndimensions);
 	for(uint32_t y = 0; y < resolution; y++) {
 		if(callback) {
 			bool keep_going = (*callback)(std::string("Resampling light directions"), 100*y/resolution);
@@ -1740,7 +2655,7 @@ void RtiBuilder::buildResampleMap(std::vector<Vector3f> &lights, std::vector<std
 			Vector3f n = fromOcta(x, y, resolution);
 
 			//compute rbf weights
-			auto &weights = remap[x + y*resolution];
+			auto &weights = rbf[x + y*resolution];
 			weights.resize(lights.size());
 			float totw = 0.0f;
 			for(size_t i = 0; i < lights.size(); i++) {
@@ -1813,25 +2728,24 @@ void RtiBuilder::buildResampleMap(std::vector<Vector3f> &lights, std::vector<std
 	Eigen::MatrixXd tI = Eigen::MatrixXd::Identity(lights.size(), lights.size());
 	Eigen::MatrixXd iA = B + iAtA*(A.transpose() * (tI - A*B));
 
-	remap.clear();
-	remap.resize(ndimensions);
+	remap.rows.assign(1, 0);
+	remap.cols.clear();
+	remap.weights.clear();
 	//rows
 	for(uint32_t i = 0; i < ndimensions; i++) {
-		auto &weights = remap[i];
-
 		//cols
 		for(uint32_t c = 0; c < lights.size(); c++) {
 			double w = iA(i, c);
-			if(fabs(w) > 0.005)
-				weights.push_back(std::make_pair(c, w));
-
+			if(fabs(w) > 0.005) {
+				remap.cols.push_back(c);
+				remap.weights.push_back(w);
+			}
 		}
+		remap.rows.push_back(remap.cols.size());
 	}
-
-	return;
 }
 
-std::vector<float> RtiBuilder::toPrincipal(Pixel &pixel) {
+std::vector<float> RtiBuilder::toPrincipal(Pixel pixel) {
 	if(!imageset.light3d || type == RBF || type == BILINEAR)
 		return toPrincipal(pixel, materialbuilder);
 
@@ -1869,7 +2783,7 @@ std::vector<float> RtiBuilder::toPrincipal(Pixel &pixel) {
 }
 
 
-std::vector<float> RtiBuilder::toPrincipal(Pixel &pixel, MaterialBuilder &materialbuilder) {
+std::vector<float> RtiBuilder::toPrincipal(Pixel pixel, MaterialBuilder &materialbuilder) {
 	float *v = (float *)pixel.data();
 	uint32_t dim = ndimensions*3;
 
@@ -1912,26 +2826,147 @@ std::vector<float> RtiBuilder::toPrincipal(Pixel &pixel, MaterialBuilder &materi
 				res[p] += col[k] * materialbuilder.proj[k + p*dim];
 			}
 		}
-		if(colorspace == YCC) {
-			int count = 0;
-			float cb = 0.0f, cr = 0.0f;
-			for(size_t p = 0; p < nplanes; p += 3) {
-				Color3f &col = *(Color3f *)&res[p];
-				col *= 1/255.0f;
-				col = col.RgbToYCbCr();
-				if(p < 9) {
-					cb += col.g;
-					cr += col.b;
-					count++;
-				}
-				if(p > 0)
-					col.g = col.b = 0.5f;
-				col *= 255.0f;
+		if(colorspace == YCC)
+			principalToYcc(res.data());
+	}
+	return res;
+}
+
+void RtiBuilder::principalToYcc(float *res) {
+	int count = 0;
+	float cb = 0.0f, cr = 0.0f;
+	for(size_t p = 0; p < nplanes; p += 3) {
+		Color3f &col = *(Color3f *)&res[p];
+		col *= 1/255.0f;
+		col = col.RgbToYCbCr();
+		if(p < 9) {
+			cb += col.g;
+			cr += col.b;
+			count++;
+		}
+		if(p > 0)
+			col.g = col.b = 0.5f;
+		col *= 255.0f;
+	}
+	res[1] = 255.0f * cb/count;
+	res[2] = 255.0f * cr/count;
+}
+
+void RtiBuilder::project(float *pixels, uint32_t npixels, MaterialBuilder &builder, float *principal, int nthreads) {
+	typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+	uint32_t dim = ndimensions*3;
+	Eigen::Map<Eigen::MatrixXf> proj(builder.proj.data(), dim, nplanes);
+	Eigen::Map<Eigen::RowVectorXf> mean(builder.mean.data(), dim);
+
+	//blocks of pixels are centered and multiplied by the basis (a gemm, blocked and vectorized by eigen).
+	const uint32_t block = 256;
+	int nblocks = (npixels + block - 1)/block;
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+	for(int b = 0; b < nblocks; b++) {
+		uint32_t start = b*block;
+		uint32_t n = std::min(block, npixels - start);
+		RowMatrix centered = Eigen::Map<RowMatrix>(pixels + size_t(start)*dim, n, dim).rowwise() - mean;
+		Eigen::Map<RowMatrix>(principal + size_t(start)*nplanes, n, nplanes).noalias() = centered*proj;
+	}
+}
+
+void RtiBuilder::toPrincipal(PixelArray &pixels, std::vector<float> &principal, MaterialBuilder &builder, int nthreads) {
+	uint32_t npixels = pixels.npixels();
+	principal.resize(size_t(npixels)*nplanes);
+
+	if(colorspace == LRGB) { //not linear
+#pragma omp parallel for num_threads(nthreads)
+		for(int x = 0; x < int(npixels); x++) {
+			vector<float> res = toPrincipal(pixels[x], builder);
+			std::copy(res.begin(), res.end(), principal.begin() + size_t(x)*nplanes);
+		}
+		return;
+	}
+	project(pixels.rawdata(), npixels, builder, principal.data(), nthreads);
+
+	if(colorspace == YCC) {
+#pragma omp parallel for num_threads(nthreads)
+		for(int x = 0; x < int(npixels); x++)
+			principalToYcc(principal.data() + size_t(x)*nplanes);
+	}
+}
+
+void RtiBuilder::toPrincipal(PixelArray &pixels, std::vector<float> &principal, int nthreads) {
+	if(!imageset.light3d || type == RBF || type == BILINEAR) {
+		toPrincipal(pixels, principal, materialbuilder, nthreads);
+		return;
+	}
+
+	//positional lights: the materialbuilders of the grid are interpolated vertically once per row (and column of the grid)
+	//each run of pixels in the same cell is projected on the 2 interpolated builders and blended horizontally.
+	//PTM and HSH builders have zero mean: projection is linear in the builder.
+	uint32_t npixels = pixels.npixels();
+	principal.resize(size_t(npixels)*nplanes);
+
+	auto column = [&](int x, float &dx) {
+		float X;
+		dx = modff((resample_width-1)*x/float(imageset.image_width), &X);
+		return int(X);
+	};
+
+	std::vector<MaterialBuilder> row(resample_width);
+	std::vector<int> row_y(resample_width, -1); //pixel row the builder has been interpolated for.
+	auto builder = [&](int X, int y) -> MaterialBuilder & {
+		MaterialBuilder &b = row[X];
+		if(row_y[X] == y)
+			return b;
+		row_y[X] = y;
+		float Y;
+		float dy = modff((resample_height-1)*y/float(imageset.image_height), &Y);
+		MaterialBuilder &top = materialbuilders[X + int(Y)*resample_width];
+		MaterialBuilder &bottom = materialbuilders[X + int(Y+1)*resample_width];
+		b.mean.resize(top.mean.size());
+		b.proj.resize(top.proj.size());
+		for(size_t k = 0; k < b.mean.size(); k++)
+			b.mean[k] = (1 - dy)*top.mean[k] + dy*bottom.mean[k];
+		for(size_t k = 0; k < b.proj.size(); k++)
+			b.proj[k] = (1 - dy)*top.proj[k] + dy*bottom.proj[k];
+		return b;
+	};
+
+	std::vector<float> right;
+	uint32_t dim = ndimensions*3;
+	for(uint32_t start = 0; start < npixels; ) {
+		float dx;
+		int y = pixels[start].y;
+		int X = column(pixels[start].x, dx);
+		uint32_t end = start + 1;
+		while(end < npixels && pixels[end].y == y && column(pixels[end].x, dx) == X)
+			end++;
+		uint32_t n = end - start;
+
+		MaterialBuilder &left = builder(X, y);
+		MaterialBuilder &next = builder(X + 1, y);
+		float *res = principal.data() + size_t(start)*nplanes;
+
+		if(colorspace == LRGB) { //not linear
+			for(uint32_t i = start; i < end; i++, res += nplanes) {
+				column(pixels[i].x, dx);
+				vector<float> a = toPrincipal(pixels[i], left);
+				vector<float> b = toPrincipal(pixels[i], next);
+				for(uint32_t p = 0; p < nplanes; p++)
+					res[p] = (1 - dx)*a[p] + dx*b[p];
+			}
+		} else {
+			right.resize(size_t(n)*nplanes);
+			project(pixels.rawdata() + size_t(start)*dim, n, left, res, nthreads);
+			project(pixels.rawdata() + size_t(start)*dim, n, next, right.data(), nthreads);
+			for(uint32_t i = 0; i < n; i++) {
+				column(pixels[start + i].x, dx);
+				float *r = res + size_t(i)*nplanes;
+				float *b = right.data() + size_t(i)*nplanes;
+				for(uint32_t p = 0; p < nplanes; p++)
+					r[p] = (1 - dx)*r[p] + dx*b[p];
+				if(colorspace == YCC)
+					principalToYcc(r);
 			}
-			res[1] = 255.0f * cb/count;
-			res[2] = 255.0f * cr/count;
 		}
+		start = end;
 	}
-	return res;
 }
 
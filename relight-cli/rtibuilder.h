@@ -6,20 +6,29 @@
 #include "../src/rti.h"
 #include "../src/imageset.h"
 #include "../src/material.h"
+#include "../src/eigenpca.h"
 
 #include <Eigen/Core>
 
 #include <functional>
 class QDir;
-
-//store pair light, coefficients for each resampled light direction.
-typedef std::vector<std::vector<std::pair<int, float>>> Resamplemap;
+class QTemporaryFile;
+class JpegEncoder;
+class Worker;
+
+//compressed sparse rows: resampled direction i is the sum of weights[k]*light[cols[k]], k from rows[i] to rows[i+1].
+struct Resamplemap {
+	std::vector<uint32_t> rows;
+	std::vector<uint32_t> cols;
+	std::vector<float> weights;
+};
 
 class RtiBuilder: public Rti {
 public:
 	ImageSet imageset;
 	float pixelSize = 0;
 	uint32_t samplingram = 500;
+	int samplebits = 0; //bits per channel of the stored samples: 8, 16, 32 (float), 0 for automatic.
 	uint32_t nsamples = 1<<16; //TODO change to rate
 	float rangescale = 1.5;
 	int skip_image = -1;
@@ -31,8 +40,43 @@ public:
 	bool savenormals = false;
 	bool savemeans = false;
 	bool savemedians = false;
-	int crop[4] = { 0, 0, 0, 0 }; //left, top, width, height
+	int crop[4] = { 0, 0, 0, 0 }; //left, top, width, height (full resolution)
 	size_t nworkers = 8;
+	uint32_t bandrows = 0; //rows processed by a worker at once, 0 for automatic
+	std::string basisfile; //info.json (or folder) of an rti to take basis and quantization from, skips sampling and pca.
+	//RBF, BILINEAR: nplanes (and yccplanes) are the fewest reaching the target, from the pca eigenvalues.
+	double target_energy = 0.0; //fraction of the variance retained, eg. 0.999
+	double target_psnr = 0.0; //estimated from the discarded variance (quantization and jpeg not included)
+	bool onepass = false; //PTM, HSH, SH, H: fit every pixel once, spill the coefficients (half float) to a temporary file, then quantize.
+
+	//a configuration of the parameter sweep, with its estimated size (bytes) and psnr (dB).
+	struct SweepConfig {
+		Type type = RBF;
+		ColorSpace colorspace = MRGB;
+		uint32_t nplanes = 9;
+		uint32_t yccplanes = 0;
+		int quality = 95;
+		size_t size = 0;
+		double psnr = 0.0;
+		bool pareto = false; //no other configuration is both smaller and better.
+	};
+	//if not empty init evaluates all the configurations on the same sample instead of building a basis.
+	std::vector<SweepConfig> sweeps;
+	double sweep_psnr = 0.0; //then builds the smallest configuration reaching this psnr (and sets quality), 0 builds none.
+	double rd_psnr = 0.0; //save: a jpeg quality per triplet of planes (at most quality), the smallest reaching this estimated psnr.
+	std::vector<int> qualities; //chosen per jpeg while saving, empty if all use quality.
+	int jpeg_threads = 1; //threads compressing stripes of each jpeg (standard huffman tables), at most nworkers/2, the jpegs are then compressed one at a time.
+	//tile each plane while fitting instead of saving the plane jpegs: plane_N.dzi and plane_N_files, or plane_N.tzb and plane_N.tzi.
+	enum Pyramid { NOPYRAMID = 0, DEEPZOOM = 1, TARZOOM = 2 };
+	Pyramid pyramid = NOPYRAMID;
+	int tilesize = 256;
+	int tileoverlap = 0;
+	int tilequality = 0; //0 uses the quality of the planes.
+	double holdout = 0.0; //fraction of the samples kept out of the fit, to estimate the error without decoding again.
+	std::vector<double> heldout_mse; //per light, on the held out samples.
+	double heldout_psnr = 0.0;
+	uint32_t crossvalidation = 0; //if > 0 init refits the shared sample leaving out this many lights at a time, nothing to save.
+	std::vector<double> crossvalidation_mse; //per light, predicted by the fit without it.
 
 	std::function<bool(std::string stage, int percent)> *callback = nullptr;
 
@@ -49,12 +93,30 @@ public:
 	bool saveJSON(QDir &dir, int quality);
 
 
-	void processLine(PixelArray &sample, PixelArray &resample, std::vector<std::vector<uint8_t>> &line,
+	//what a worker does with a band: fit and quantize, fit and spill, quantize the spilled coefficients.
+	enum Pass { PROCESS = 0, FIT = 1, QUANTIZE = 2 };
+
+	void processLine(PixelArray &sample, PixelArray &resample, std::vector<float> &principals,
 					 std::vector<uchar> &normal, std::vector<uchar> &mean, std::vector<uchar> &median);
+	void quantizeLine(float *principals, uint32_t npixels, std::vector<std::vector<uint8_t>> &line);
+	//coefficients of the spill file from row, rows*width*nplanes floats.
+	void spilledPrincipals(uint32_t row, uint32_t rows, std::vector<float> &principals);
+	void spillPrincipals(uint32_t row, uint32_t rows, std::vector<float> &principals);
 
 protected:
 	MaterialBuilder materialbuilder;
 
+	uint32_t bandRows();
+	//decode the images in bands, process them in parallel and call write for each band, in order, on a separate thread.
+	//write_threads: threads used by write (the writer included), taken from the nworkers fitting the bands.
+	bool processBands(std::function<void(Worker &worker, uint32_t first_row)> write, Pass pass = PROCESS, uint32_t write_threads = 1);
+
+	QTemporaryFile *spill = nullptr; //onepass coefficients, width*height*nplanes half floats.
+	Eigen::half *spilled = nullptr;
+	bool onePass();
+	//fit the coefficients of all the pixels, spill them and compute the quantization, write gets the fitted bands.
+	bool spillCoefficients(std::function<void(Worker &worker, uint32_t first_row)> write = nullptr);
+
 	//for each resample pos get coeffs from the origina lights.
 	Resamplemap resamplemap;
 
@@ -62,36 +124,74 @@ protected:
 	int resample_width = 9, resample_height = 9;
 	std::vector<Resamplemap> resamplemaps;  //for per pixel direction light interpolation
 	std::vector<MaterialBuilder> materialbuilders;
+	//mean and covariance streamed while sampling (one per thread, then reduced), 3 (one per component) for MYCC.
+	std::vector<PCA> covariances;
 
 	//TODO this should go inimageset!
 	//compute the 3d lights relative to the pixel x, y
 	std::vector<Vector3f> relativeLights(int x, int y);
 
-	void resamplePixel(Pixel &sample, Pixel &pixel);
+	//resample has the same number of pixels as sample.
+	void resamplePixels(PixelArray &sample, PixelArray &resample);
 
-	void buildResampleMap(std::vector<Vector3f> &lights, std::vector<std::vector<std::pair<int, float> > > &remap);
+	void buildResampleMap(std::vector<Vector3f> &lights, Resamplemap &remap);
 	void buildResampleMaps();
-	void remapPixel(Pixel &sample, Pixel &pixel, Resamplemap &resamplemap, float weight);
-
-
-
-	MaterialBuilder pickBase(PixelArray &sample, std::vector<Vector3f> &lights);
+	//resample += weight*remap*sample for pixels start to end, one weight per pixel (nullptr for 1).
+	void remapPixels(PixelArray &sample, PixelArray &resample, uint32_t start, uint32_t end, Resamplemap &remap, const float *weights = nullptr);
+
+
+
+	bool loadBasis(const std::string &filename);
+	//samples of all the lights, no resampling.
+	void sampleLights(SampleArray &raw);
+	bool crossValidate();
+	bool sweep();
+	void setConfiguration(SweepConfig &config);
+	//basis and quantization from samples of all the lights, resampled for the current configuration.
+	void fitSamples(SampleArray &raw);
+	void reduceCovariances();
+	void choosePlanes();
+	//a few strips of rows across the image, returns the number of rows.
+	uint32_t readProbe(PixelArray &probe);
+	//quantized planes of the probe, interleaved by triplets as the jpegs.
+	void quantizeProbe(PixelArray &probe, std::vector<std::vector<uint8_t>> &line);
+	//jpeg size of a triplet of probe planes, decoded as the viewer would.
+	size_t compressProbe(std::vector<uint8_t> &line, uint32_t rows, uint32_t plane, int quality, std::vector<uint8_t> &decoded);
+	//mse of the rendered planes against the original pixels of the probe.
+	double renderError(Rti &rti, PixelArray &probe, std::vector<double> *perlight = nullptr);
+	//size and psnr of the probe rows compressed and rendered.
+	void evaluateConfiguration(PixelArray &probe, uint32_t probe_rows, SweepConfig &config);
+	void allocateQualities(int quality);
+	//mse of each light on the samples kept out of the fit, after quantization.
+	void estimateHeldout(SampleArray &heldout);
+	//scale, bias, range and quantized basis as saved.
+	void exportMaterial();
+	void setupEncoder(JpegEncoder *encoder, uint32_t plane, int quality);
+	int sampleBits();
+	//16 bits samples must hold the intensity compensated values (resampling may overshoot a bit).
+	void sampleRange(SampleArray &sample);
+	void accumulateCovariance(PixelArray &resampled);
+	//call process for each chunk of samples (starting at start), converted to float.
+	void scanSamples(SampleArray &sample, std::function<void(uint32_t start, PixelArray &pixels)> process);
+
+	MaterialBuilder pickBase(SampleArray &sample, std::vector<Vector3f> &lights);
 	//use for 3d lights
-	void pickBases(PixelArray &sample);
+	void pickBases(SampleArray &sample);
 	//PTM or HSH + bad light sampling could overestimate, here histogram is renormalized.
 	//TODO: check for underestimate, expose parameter.
-	void normalizeHistogram(PixelArray &sample, double percentile = 0.95);
+	void normalizeHistogram(SampleArray &sample, double percentile = 0.95);
 
-	void minmaxMaterial(PixelArray &sample);
+	void minmaxMaterial(SampleArray &sample);
+	void commonMinMaxMaterial();
 	void finalizeMaterial();
 
 
 
-	void estimateError(PixelArray &sample, std::vector<float> &weights);
+	void estimateError(SampleArray &sample, std::vector<float> &weights);
 	void getPixelMaterial(PixelArray &pixels, std::vector<size_t> &indices);
 	void getPixelBestMaterial(PixelArray &pixels, std::vector<size_t> &indices);
 
-	MaterialBuilder pickBasePCA(PixelArray &sample);
+	MaterialBuilder pickBasePCA(SampleArray &sample);
 	MaterialBuilder pickBasePTM(std::vector<Vector3f> &lights);
 	MaterialBuilder pickBaseHSH(std::vector<Vector3f> &lights, Type base = HSH);
 
@@ -103,8 +203,14 @@ protected:
 	//void savePixel(Color3f *p, int side, const QString &file);
 	void debugMaterials();
 
-	std::vector<float> toPrincipal(Pixel &pixel, MaterialBuilder &materialbuilder);
-	std::vector<float> toPrincipal(Pixel &pixel);
+	std::vector<float> toPrincipal(Pixel pixel, MaterialBuilder &materialbuilder);
+	std::vector<float> toPrincipal(Pixel pixel);
+	//batched versions: principal holds nplanes coefficients for each pixel.
+	void toPrincipal(PixelArray &pixels, std::vector<float> &principal, MaterialBuilder &materialbuilder, int nthreads = 1);
+	void toPrincipal(PixelArray &pixels, std::vector<float> &principal, int nthreads = 1);
+	//principal = (pixels - mean)*proj, pixels and principal are row major.
+	void project(float *pixels, uint32_t npixels, MaterialBuilder &builder, float *principal, int nthreads = 1);
+	void principalToYcc(float *principal);
 
 };
 
@@ -38,6 +38,7 @@ SOURCES += main.cpp \
     ../src/imageset.cpp \
     ../src/lp.cpp \
     ../src/jpeg_encoder.cpp \
+    ../src/deepzoom.cpp \
     ../relight-cli/rtibuilder.cpp
 
 HEADERS += \
@@ -46,4 +47,5 @@ HEADERS += \
     ../src/imageset.h \
     ../src/lp.h \
     ../src/jpeg_encoder.h \
+    ../src/deepzoom.h \
     ../relight-cli/rtibuilder.h
@@ -43,6 +43,7 @@ void NormalsTask::run()
     int start = clock();
     // Init
 	imageSet.setCallback(nullptr);
+	imageSet.decode_threads = QThread::idealThreadCount();
 
     // Set the crop
     if(!m_Crop.isValid()) {
@@ -58,23 +59,26 @@ void NormalsTask::run()
 
     // Thread pool used to handle the processors
     RelightThreadPool pool;
-    // Line in the imageset to be processed
-    PixelArray line;
+    int nthreads = QThread::idealThreadCount();
+    // Rows decoded at once, each band is processed by a worker
+    int nrows = 16;
+    // Bands stay valid while queued or running (2*nthreads at most), plus the one being read.
+    imageSet.ring_size = 2*nthreads + 2;
 
-    pool.start(QThread::idealThreadCount());
+    pool.start(nthreads);
 
-    for (int i=0; i<imageSet.height; i++)
+    for (int i=0; i<imageSet.height; i += nrows)
     {
-        // Read a line
-        imageSet.readLine(line);
+        // Read a band of rows
+        PixelArray &band = imageSet.readBand(nrows);
 
         // Create the normal task and get the run lambda
         uint32_t idx = i * 3 * imageSet.width;
         //uint8_t* data = normals.data() + idx;
         float* data = &normals[idx];
 
-		std::function<void(void)> run = [this, &i, &line, &imageSet, data](void)->void {
-			NormalsWorker task(solver, i, line, data, imageSet);
+		std::function<void(void)> run = [this, &band, &imageSet, data](void)->void {
+			NormalsWorker task(solver, band, data, imageSet);
             return task.run();
         };
 
@@ -161,9 +165,6 @@ void NormalsWorker::run()
         solveRPCA();
         break;
     }
-
-    // Deallocate line (TODO: useless?)
-    std::vector<Pixel>().swap(m_Row);
 }
 
 
@@ -192,7 +193,7 @@ void NormalsWorker::solveL2()
 
 		if(m_Imageset.light3d) {
 			for(int i = 0; i < m_Lights.size(); i++) {
-				Vector3f lights = m_Imageset.relativeLight(m_Lights[i], p, row);
+				Vector3f lights = m_Imageset.relativeLight(m_Lights[i], m_Row[p].x, m_Row[p].y);
 				for (int j = 0; j < 3; j++)
 					mLights(i, j) = m_Lights[i][j];
 			}
@@ -44,8 +44,8 @@ private:
 class NormalsWorker
 {
 public:
-	NormalsWorker(NormalSolver _solver, int _row, PixelArray& toProcess, float* normals, ImageSet &imageset) :
-		 solver(_solver), row(_row), m_Row(toProcess), m_Normals(normals), m_Imageset(imageset){}
+	NormalsWorker(NormalSolver _solver, PixelArray& toProcess, float* normals, ImageSet &imageset) :
+		 solver(_solver), m_Row(toProcess), m_Normals(normals), m_Imageset(imageset){}
 
     void run();
 private:
@@ -55,8 +55,7 @@ private:
 private:
 
     NormalSolver solver;
-	int row;
-    PixelArray m_Row;
+    PixelArray &m_Row; //band of rows in the imageset ring
     //uint8_t* m_Normals;
     float* m_Normals;
 	ImageSet &m_Imageset;
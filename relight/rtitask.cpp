@@ -32,7 +32,13 @@ void RtiTask::run() {
 	QStringList steps = (*this)["steps"].value.toStringList();
     std::function<bool(std::string s, int d)> callback = [this](std::string s, int n)->bool { return this->progressed(s, n); };
     QString err;
+	//relight writes the tiles directly, the plane jpegs are not needed.
+	bool tiled = steps.contains("relight") && steps.contains("deepzoom");
+	if(tiled)
+		pyramid = steps.contains("tarzoom") ? RtiBuilder::TARZOOM : RtiBuilder::DEEPZOOM;
     for(auto step: steps) {
+		if(tiled && (step == "deepzoom" || step == "tarzoom"))
+			continue;
 		if(step == "relight")
 			relight();
 		else if(step == "rti")
@@ -70,7 +76,10 @@ void  RtiTask::relight(bool commonMinMax, bool saveLegacy) {
 	builder->pixelSize =(*this)["pixelSize"].value.toDouble();
 	builder->commonMinMax = commonMinMax;
 
+	builder->pyramid = RtiBuilder::Pyramid(pyramid);
+	builder->tilequality = 95; //as the deepzoom step.
 	builder->nworkers = QSettings().value("nworkers", 8).toInt();
+	builder->imageset.decode_threads = builder->nworkers;
 	builder->samplingram = QSettings().value("ram", 512).toInt();
 
 	builder->samplingram = (*this)["ram"].value.toInt();
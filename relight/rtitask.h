@@ -11,8 +11,8 @@ class RtiBuilder;
  *   relight: creates an RTI in relight format
  *   toRTI: converts a relight to an .rti format
  *   fromRTI: converts an .rti to relight
- *   deepzoom: splits relight in tiles
- *   tarzoom: merges deepzoom tiles
+ *   deepzoom: splits relight in tiles (written by relight if both are present)
+ *   tarzoom: merges deepzoom tiles (as above)
  *   itarzoom: merges tarzoom in a single itarzoom
  *   openlime: add openlime js css, html for viewer
  */
@@ -37,6 +37,7 @@ public slots:
 
 private:
 	RtiBuilder *builder = nullptr;
+	int pyramid = 0; //RtiBuilder::Pyramid for relight.
 
 };
 
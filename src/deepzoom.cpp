@@ -4,6 +4,10 @@
 
 #include <QDir>
 #include <QDebug>
+#include <QTemporaryFile>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QJsonDocument>
 
 #include <iostream>
 #include <fstream>
@@ -31,13 +35,14 @@ vector<uint8_t>  TileRow::scaleLines( std::vector<uint8_t> &line0, std::vector<u
 	return scaled;
 }
 
-TileRow::TileRow(int _tileside, int _overlap, QString _path, int _width, int _height, int _quality) {
+TileRow::TileRow(int _tileside, int _overlap, QString _path, int _width, int _height, int _quality, QFile *_tar) {
 	tileside = _tileside;
 	overlap = _overlap;
 	path = _path;
 	width = _width;
 	height = _height;
 	quality = _quality;
+	tar = _tar;
 	end_tile = 0;
 	nextRow();
 }
@@ -79,7 +84,12 @@ std::vector<uint8_t> TileRow::addLine(std::vector<uint8_t> newline) {
 
 void TileRow::finishRow() {
 	for(Tile &tile: *this) {
-		tile.encoder->finish();
+		size_t size = tile.encoder->finish();
+		if(tar) {
+			tar->write((const char *)tile.encoder->data(), size);
+			sizes.push_back(size);
+		}
+		bytes += size;
 		delete tile.encoder;
 	}
 	clear();
@@ -101,8 +111,12 @@ void TileRow::nextRow() {
 		tile.encoder = new JpegEncoder();
 		tile.encoder->setQuality(quality);
 		tile.encoder->setColorSpace(JCS_RGB, 3);
-		QString filepath = QString("%1/%2_%3.jpg").arg(path).arg(col).arg(current_row); //path + "/" +  QString::number(col) + "_" + QString::numberto_string(current_row) + ".jpg");
-		tile.encoder->init(filepath.toStdString().c_str(), tile.width, h);
+		if(tar)
+			tile.encoder->initMemory(tile.width, h);
+		else {
+			QString filepath = QString("%1/%2_%3.jpg").arg(path).arg(col).arg(current_row); //path + "/" +  QString::number(col) + "_" + QString::numberto_string(current_row) + ".jpg");
+			tile.encoder->init(filepath.toStdString().c_str(), tile.width, h);
+		}
 		push_back(tile);
 
 		col++;
@@ -121,33 +135,106 @@ void TileRow::nextRow() {
 
 
 
+DeepZoom::~DeepZoom() {
+	//not finished (cancelled or failed): tiles being compressed and tarzoom temporary files.
+	for(TileRow &row: rows) {
+		for(Tile &tile: row)
+			delete tile.encoder;
+		delete row.tar;
+	}
+}
+
 bool DeepZoom::build(QString input, QString _output, int _tileside, int _overlap) {
+	JpegDecoder decoder;
+	int w, h;
+	bool ok = decoder.init(input.toStdString().c_str(), w, h);
+	if(!ok) return false;
+
+	if(!init(_output, w, h, _tileside, _overlap))
+		return false;
+
+	//line by line
+	std::vector<uint8_t> line(width*3);
+	for(int y = 0; y < height; y++) {
+		decoder.readRows(1, line.data());
+		addRows(line.data(), 1);
+	}
+	finish();
+	return true;
+}
+
+bool DeepZoom::init(QString _output, int _width, int _height, int _tileside, int _overlap) {
 	output = _output;
+	width = _width;
+	height = _height;
 	tileside = _tileside;
 	overlap = _overlap;
 
 	//create folder filename-ext_files and text file
+	if(!tarzoom && !QDir().mkpath(output + "_files"))
+		return false;
 
-	JpegDecoder decoder;
-	bool ok = decoder.init(input.toStdString().c_str(), width, height);
-	if(!ok) return false;
-
-	QDir().mkdir(output + "_files");
-
+	rows.clear();
+	widths.clear();
+	heights.clear();
 	initRows();
+	return true;
+}
 
+void DeepZoom::addRows(uint8_t *data, int n) {
 	//for each level
-	//line by line
-    for(int y = 0; y < height; y++) {
-		std::vector<uint8_t> line(width*3);
-		decoder.readRows(1, line.data());
-
+	for(int y = 0; y < n; y++) {
+		std::vector<uint8_t> line(data + size_t(y)*width*3, data + size_t(y+1)*width*3);
 		for(size_t i = 0; i < rows.size(); i++) {
 			line = rows[i].addLine(line);
 			if(!line.size())
 				break;
 		}
 	}
+}
+
+size_t DeepZoom::finish() {
+	size_t total = 0;
+	for(TileRow &row: rows)
+		total += row.bytes;
+
+	if(tarzoom) {
+		//levels from the smallest, tiles by row, offsets as tarzoom.
+		QFile tzb(output + ".tzb");
+		if(!tzb.open(QFile::WriteOnly))
+			return 0;
+		QJsonArray offsets;
+		size_t offset = 0;
+		offsets.push_back(double(offset));
+		for(int i = int(rows.size()) - 1; i >= 0; i--) {
+			TileRow &row = rows[i];
+			row.tar->seek(0);
+			tzb.write(row.tar->readAll());
+			for(uint32_t size: row.sizes) {
+				offset += size;
+				offsets.push_back(double(offset));
+			}
+			delete row.tar;
+			row.tar = nullptr;
+		}
+		tzb.close();
+
+		QJsonObject index;
+		index.insert("tilesize", tileside);
+		index.insert("overlap", overlap);
+		index.insert("format", "jpg");
+		index.insert("nlevels", int(rows.size()));
+		index.insert("width", width);
+		index.insert("height", height);
+		index.insert("offsets", offsets);
+
+		QFile tzi(output + ".tzi");
+		if(!tzi.open(QFile::WriteOnly))
+			return 0;
+		tzi.write(QJsonDocument(index).toJson());
+		rows.clear();
+		return total;
+	}
 
 	std::ofstream out;
 	out.open(output.toStdString() + ".dzi");
@@ -160,8 +247,8 @@ bool DeepZoom::build(QString input, QString _output, int _tileside, int _overlap
 	out << "  <Size Height=\"" << height << "\" Width=\"" << width << "\"/>\n";
 	out << "</Image>\n";
 	out.close();
-
-	return true;
+	rows.clear();
+	return total;
 }
 
 int DeepZoom::nLevels() {
@@ -184,9 +271,14 @@ void DeepZoom::initRows() {
 	while(level >= 0) {
 		//create folder.
 		QString level_path = path + "/" + QString::number(level);
-		QDir().mkdir(level_path);
-
-		TileRow row(tileside, overlap, level_path, w, h, quality);
+		QTemporaryFile *tar = nullptr;
+		if(tarzoom) {
+			tar = new QTemporaryFile;
+			tar->open();
+		} else
+			QDir().mkdir(level_path);
+
+		TileRow row(tileside, overlap, level_path, w, h, quality, tar);
 		rows.push_back(row);
 
 		widths.push_back(w);
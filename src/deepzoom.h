@@ -7,6 +7,7 @@
 #include <QString>
 
 class JpegEncoder;
+class QFile;
 
 class Tile {
 public:
@@ -24,6 +25,9 @@ public:
 	int width;  //total width of the scaled image;
 	int height; //total height of the scaled image;
 	int quality; //0 100 jpeg quality.
+	QFile *tar = nullptr; //tiles compressed in memory and appended here in order, instead of a file each.
+	std::vector<uint32_t> sizes; //of the tiles in tar.
+	size_t bytes = 0; //total size of the tiles.
 
 	int current_row = -1;
 	int current_line = 0;                          //keeps track of which image line we are processing
@@ -33,7 +37,7 @@ public:
 
 
 	TileRow() {}
-	TileRow(int _tileside, int _overlap, QString path, int width, int height, int quality = 95);
+	TileRow(int _tileside, int _overlap, QString path, int width, int height, int quality = 95, QFile *tar = nullptr);
 	void nextRow();
 	void finishRow();
 
@@ -53,9 +57,16 @@ public:
 	int overlap = 1;
 	int width, height;
 	int quality; //0 100 jpeg quality
+	bool tarzoom = false; //write output.tzb and output.tzi (as tarzoom) instead of output_files and output.dzi
 	QString output;
+	~DeepZoom();
 	bool build(QString filename, QString basename, int tile_size = 254, int overlap = 1);
 
+	//streaming: rows of the image from the top, finish writes the index and returns the total size.
+	bool init(QString basename, int width, int height, int tile_size = 254, int overlap = 1);
+	void addRows(uint8_t *data, int n);
+	size_t finish();
+
 private:
 	std::vector<TileRow> rows;      //one row per level
 	std::vector<int> heights;
@@ -2,12 +2,13 @@
 #define EIGENPCA_H
 
 #include <Eigen/Eigenvalues>
+#include <assert.h>
 
 
 
 class PCA {
 public:
-	PCA();
+	PCA() {}
 	PCA(int num_vars, int n_records) {
 		resize(num_vars, n_records);
 	}
@@ -22,16 +23,75 @@ public:
 		records.row(row) = v;
 	}
 
+	//streaming: mean and centred scatter of the records (rows of batch) are updated instead of storing them.
+	//each batch is centred on its own mean and merged (Chan et al.), to avoid the cancellation of gram - n*m*mt.
+	template <class Batch> void accumulate(const Batch &batch) {
+		if(batch.rows() == 0)
+			return;
+		PCA part;
+		Eigen::MatrixXd b = batch.template cast<double>();
+		part.count = b.rows();
+		part.mu = b.colwise().mean().transpose();
+		b.rowwise() -= part.mu.transpose();
+		part.scatter = Eigen::MatrixXd::Zero(b.cols(), b.cols());
+		part.scatter.selfadjointView<Eigen::Lower>().rankUpdate(b.adjoint());
+		merge(part);
+	}
+	//add the records of another (thread) pca.
+	void merge(const PCA &pca) {
+		if(pca.count == 0)
+			return;
+		if(count == 0) {
+			scatter = pca.scatter;
+			mu = pca.mu;
+			count = pca.count;
+		} else {
+			double n = double(count + pca.count);
+			Eigen::VectorXd delta = pca.mu - mu;
+			scatter += pca.scatter;
+			scatter.selfadjointView<Eigen::Lower>().rankUpdate(delta, double(count)*double(pca.count)/n);
+			mu += delta*(double(pca.count)/n);
+			count += pca.count;
+		}
+		eigenvalues.resize(0);
+	}
+	Eigen::VectorXd mean() {
+		return mu;
+	}
+	size_t accumulated() { return count; }
 
-	void solve(int n) {
-		Eigen::MatrixXd cov = records.adjoint() * records;
-		cov = cov / (records.rows() - 1);
+	//eigen decomposition of the covariance, eigenvalues and eigenvectors in decreasing order.
+	void decompose() {
+		Eigen::MatrixXd cov;
+		if(count) {
+			cov = scatter.selfadjointView<Eigen::Lower>();
+			cov = cov / double(count - 1);
+		} else {
+			cov = records.adjoint() * records;
+			cov = cov / (records.rows() - 1);
+		}
 
 		Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(cov);
-		Eigen::VectorXd normalizedEigenValues =  eig.eigenvalues() / eig.eigenvalues().sum();
+		eigenvalues = eig.eigenvalues().reverse();
+		eigenvectors = eig.eigenvectors().rowwise().reverse();
+		//a positive semidefinite matrix: only rounding can make the smallest ones (slightly) negative.
+		assert(eigenvalues.size() == 0 || eigenvalues.minCoeff() >= -1e-9*std::max(1.0, eigenvalues.maxCoeff()));
+	}
 
-		Eigen::MatrixXd eigenVectors = eig.eigenvectors();
-		transform = eigenVectors.rightCols(n).rowwise().reverse();
+	void solve(int n) {
+		if(eigenvalues.size() == 0)
+			decompose();
+		transform = eigenvectors.leftCols(n);
+	}
+	//variance left out by the first n components.
+	double residual(int n) {
+		if(eigenvalues.size() == 0)
+			decompose();
+		n = std::min<int>(n, eigenvalues.size());
+		return eigenvalues.tail(eigenvalues.size() - n).sum();
+	}
+	double variance() {
+		return residual(0);
 	}
 
 	//TODO: is it bettrer or worse?
@@ -47,6 +107,13 @@ public:
 
 	Eigen::MatrixXd records;
 	Eigen::MatrixXd transform;
+	Eigen::VectorXd eigenvalues;
+	Eigen::MatrixXd eigenvectors;
+
+protected:
+	size_t count = 0;
+	Eigen::VectorXd mu;
+	Eigen::MatrixXd scatter; //sum of (record - mu)(record - mu)t, lower triangle only
 };
 
 #endif // EIGENPCA_H
@@ -1,10 +1,11 @@
 #include <string>
-#include <set>
 #include <iostream>
 #include <QDir>
 #include <QFile>
 #include <QTextStream>
 #include <QImage>
+#include <QFileInfo>
+#include <QDateTime>
 
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -16,17 +17,66 @@
 
 
 #include <assert.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
+//map the whole file and close it: the mapping outlives the descriptor and the pages are read (and dropped) by the kernel as needed.
+static bool mapImage(const QString &path, uint8_t *&data, size_t &size) {
+#ifdef _WIN32
+	QFile file(path);
+	if(!file.open(QFile::ReadOnly))
+		return false;
+	size = file.size();
+	data = new uint8_t[size];
+	if(file.read((char *)data, size) != qint64(size)) {
+		delete []data;
+		data = nullptr;
+		return false;
+	}
+	return true;
+#else
+	int fd = ::open(path.toLocal8Bit().constData(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	size = st.st_size;
+	void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if(p == MAP_FAILED)
+		return false;
+	data = (uint8_t *)p;
+	return true;
+#endif
+}
+
 ImageSet::ImageSet(const char *path) {
 	if(path)
 		initFromFolder(path);
 }
 
 ImageSet::~ImageSet() {
+	closeCache();
 	//TODO decoders should take care to properly finish
 	for(JpegDecoder *dec: decoders)
 		delete dec;
+	for(Source &source: sources) {
+#ifdef _WIN32
+		delete []source.data;
+#else
+		munmap(source.data, source.size);
+#endif
+	}
 }
 
 void ImageSet::parseLP(QString sphere_path, std::vector<Vector3f> &lights, std::vector<QString> &filenames, int skip_image) {
@@ -176,7 +226,8 @@ void ImageSet::initLights() {
 #include <sys/resource.h>
 #endif
 bool ImageSet::initImages(const char *_path) {
-	int noFilesNeeded = images.size() + 50;
+	//in_memory: the compressed images are mapped (in RAM on windows) and no file is kept open.
+	int noFilesNeeded = in_memory ? 50 : images.size() + 50;
 #ifdef _WIN32
 	int maxfiles = _getmaxstdio();
 	if(maxfiles < noFilesNeeded) {
@@ -199,11 +250,22 @@ bool ImageSet::initImages(const char *_path) {
 #endif
 
 	QDir dir(_path);
+	if(in_memory)
+		sources.reserve(images.size());
 	for(int i = 0; i < images.size(); i++) {
 		QString filepath = dir.filePath(images[i]);
 		int w, h;
 		JpegDecoder *dec = new JpegDecoder;
-		if(!dec->init(filepath.toStdString().c_str(), w, h))
+		dec->setScale(scale);
+		if(in_memory) {
+			Source source;
+			if(!mapImage(filepath, source.data, source.size))
+				throw QString("Failed reading image: " + filepath);
+			sources.push_back(source);
+			if(!dec->init(source.data, source.size, w, h))
+				throw QString("Failed decoding image: " + filepath);
+
+		} else if(!dec->init(filepath.toStdString().c_str(), w, h))
 			throw QString("Failed decoding image: " + filepath);
 
 		if(width && (width != w || height != h))
@@ -212,6 +274,9 @@ bool ImageSet::initImages(const char *_path) {
 		right = image_width = width = w;
 		bottom = image_height = height = h;
 
+		QFileInfo info(filepath);
+		signature = uint32_t(qHash(images[i] + QString::number(info.size()) + info.lastModified().toString(), signature));
+
 		decoders.push_back(dec);
 	}
 	return true;
@@ -219,11 +284,11 @@ bool ImageSet::initImages(const char *_path) {
 
 
 void ImageSet::crop(int _left, int _top, int _width, int _height) {
-	left = _left;
-	top = _top;
+	left = _left/scale;
+	top = _top/scale;
 	if(_width > 0) {
-		width = _width;
-		height = _height;
+		width = std::max(1, _width/scale);
+		height = std::max(1, _height/scale);
 	}
 	right = left + width;
 	bottom = top + height;
@@ -232,6 +297,17 @@ void ImageSet::crop(int _left, int _top, int _width, int _height) {
 		cout << "left: " << left << " top: " << top << " right: " << right << " bottom: " << bottom << " width: " << width << " height: " << height << endl;
 		throw "Invalid crop parameters";
 	}
+
+	//decode only the columns needed, crop is applied when the decoders restart.
+	int nimages = decoders.size();
+#pragma omp parallel for num_threads(decode_threads)
+	for(int i = 0; i < nimages; i++) {
+		decoders[i]->setCrop(left, width);
+		decoders[i]->restart();
+	}
+	crop_x = nimages ? decoders[0]->cropX() : 0;
+	current_line = 0;
+	closeCache();
 }
 
 QImage ImageSet::maxImage(std::function<bool(std::string stage, int percent)> *callback) {
@@ -242,19 +318,22 @@ QImage ImageSet::maxImage(std::function<bool(std::string stage, int percent)> *c
 	
 	uint8_t *row = new uint8_t[w*h*3];
 	
-	restart();
+	//reads the decoders directly (even with a cache), then leaves them at the top as restart does.
+	restartDecoders();
+	current_line = 0;
+	cache_rows = 0;
 	for(int y = 0; y < image_height; y++) {
 		if(callback) {
 			bool keep_going = (*callback)(std::string("Sampling images"), 100*(y-top)/(height-1));
 			if(!keep_going)
 				throw 1;
 		}
-		uint8_t *rowmax = image.scanLine(y);
+		uint8_t *rowmax = image.scanLine(y) + crop_x*3;
 		for(uint32_t i = 0; i < decoders.size(); i++) {
 			JpegDecoder *dec = decoders[i];
 			dec->readRows(1, row);
 			
-			for(int x = 0; x < image_width; x++) {
+			for(int x = 0; x < dec->outputWidth(); x++) {
 				rowmax[x*3 + 0] = std::max(rowmax[x*3 + 0], row[x*3 + 0]);
 				rowmax[x*3 + 1] = std::max(rowmax[x*3 + 1], row[x*3 + 0]);
 				rowmax[x*3 + 2] = std::max(rowmax[x*3 + 2], row[x*3 + 0]);
@@ -262,6 +341,8 @@ QImage ImageSet::maxImage(std::function<bool(std::string stage, int percent)> *c
 		}
 	}
 	delete []row;
+	restartDecoders();
+	current_line = 0;
 	return image;
 }
 
@@ -281,124 +362,314 @@ Vector3f ImageSet::relativeLight(const Vector3f &light, int x, int y){
 }
 
 void ImageSet::readLine(PixelArray &pixels) {
+	readRows(pixels, 1);
+}
+
+PixelArray &ImageSet::readBand(int nrows) {
+	if(ring.size() != size_t(ring_size)) {
+		ring.resize(ring_size);
+		ring_pos = 0;
+	}
+	PixelArray &pixels = ring[ring_pos];
+	ring_pos = (ring_pos + 1) % ring.size();
+
+	readRows(pixels, nrows);
+	return pixels;
+}
+
+void ImageSet::skipRows(int nrows) {
 	if(current_line == 0)
 		skipToTop();
-	pixels.resize(width, images.size());
-	for(uint32_t x = 0; x < pixels.size(); x++) {
-		Pixel &pixel = pixels[x];
-		pixel.x = x + left;
-		pixel.y = image_height - 1 - current_line;
-	}
 
-	//TODO: no need to allocate EVERY time.
-	std::vector<uint8_t> row(image_width*3);
+	nrows = std::max(0, std::min(nrows, bottom - current_line));
+	if(!cache_data && nrows) {
+		//the cache needs all the rows.
+		closeCache();
+		int nimages = decoders.size();
+#pragma omp parallel for schedule(dynamic) num_threads(decode_threads)
+		for(int i = 0; i < nimages; i++)
+			decoders[i]->skipRows(nrows);
+	}
+	current_line += nrows;
+}
 
-	for(size_t i = 0; i < decoders.size(); i++) {
-		decoders[i]->readRows(1, row.data());
+void ImageSet::readRows(PixelArray &pixels, int nrows) {
+	if(current_line == 0)
+		skipToTop();
 
-		for(int x = left; x < right; x++) {
-			pixels[x - left][i].r = row[x*3 + 0];
-			pixels[x - left][i].g = row[x*3 + 1];
-			pixels[x - left][i].b = row[x*3 + 2];
+	nrows = std::max(0, std::min(nrows, bottom - current_line));
+	pixels.resize(width*nrows, images.size());
+	for(int r = 0; r < nrows; r++) {
+		for(int x = 0; x < width; x++) {
+			Pixel pixel = pixels[x + r*width];
+			pixel.x = x + left;
+			pixel.y = image_height - 1 - (current_line + r);
 		}
 	}
-	//compensate intensity.
-	if(light3d) {
-		assert(lights3d.size() == size_t(images.size()));
-		for(Pixel &pixel: pixels) {
-			for(size_t i = 0; i < lights3d.size(); i++) {
-				Vector3f l = relativeLight(lights3d[i], pixel.x, pixel.y);
-				float r = l.squaredNorm();
-				float di = r / (dome_radius*dome_radius);
-				pixel[i].r *= di;
-				pixel[i].g *= di;
-				pixel[i].b *= di;
+
+	if(cache_data) {
+		//same layout as the pixel array.
+		const uint8_t *rows = cacheRow(current_line - top);
+		float *data = pixels.rawdata();
+		int64_t n = int64_t(nrows)*width*images.size()*3;
+#pragma omp parallel for num_threads(decode_threads)
+		for(int64_t k = 0; k < n; k++)
+			data[k] = rows[k];
+	} else {
+		size_t rowsize = decoders[0]->rowSize();
+		band.resize(decoders.size()*nrows*rowsize);
+
+		//each image is an independent stream, decode them concurrently.
+		int nimages = decoders.size();
+#pragma omp parallel for schedule(dynamic) num_threads(decode_threads)
+		for(int i = 0; i < nimages; i++) {
+			uint8_t *rows = band.data() + i*nrows*rowsize;
+			decoders[i]->readRows(nrows, rows);
+
+			LightSlice light = pixels.light(i);
+			for(int r = 0; r < nrows; r++) {
+				uint8_t *row = rows + r*rowsize + (left - crop_x)*3;
+				for(int x = 0; x < width; x++) {
+					Color3f &c = light[x + r*width];
+					c.r = row[x*3 + 0];
+					c.g = row[x*3 + 1];
+					c.b = row[x*3 + 2];
+				}
 			}
 		}
+		writeCache(nrows);
 	}
-	current_line++;
+	if(light3d)
+		compensateIntensity(pixels);
+	current_line += nrows;
 }
 
-//return a subset of k integers from 0 to n-1;
-class StupidSampler {
+void ImageSet::buildFalloff() {
+	//same as relativeLight(light, x, y).squaredNorm(): dx depends only on x, dy and dz only on y.
+	size_t nlights = lights3d.size();
+	float r2 = dome_radius*dome_radius;
+	falloff_x.resize(size_t(image_width)*nlights);
+	falloff_y.resize(size_t(image_height)*nlights);
+	for(int x = 0; x < image_width; x++) {
+		for(size_t i = 0; i < nlights; i++) {
+			float dx = lights3d[i][0] - (x - width/2.0f)/width;
+			falloff_x[x*nlights + i] = dx*dx/r2;
+		}
+	}
+	for(int y = 0; y < image_height; y++) {
+		for(size_t i = 0; i < nlights; i++) {
+			float dy = lights3d[i][1] - (y - height/2.0f)/width;
+			float dz = lights3d[i][2] + vertical_offset/width;
+			falloff_y[y*nlights + i] = (dy*dy + dz*dz)/r2;
+		}
+	}
+}
+
+float ImageSet::maxFalloff() {
+	if(!light3d)
+		return 1.0f;
+	size_t nlights = lights3d.size();
+	if(falloff_x.size() != size_t(image_width)*nlights || falloff_y.size() != size_t(image_height)*nlights)
+		buildFalloff();
+	float m = 0.0f;
+	for(size_t i = 0; i < nlights; i++) {
+		float mx = 0.0f, my = 0.0f;
+		for(int x = 0; x < image_width; x++)
+			mx = std::max(mx, falloff_x[x*nlights + i]);
+		for(int y = 0; y < image_height; y++)
+			my = std::max(my, falloff_y[y*nlights + i]);
+		m = std::max(m, mx + my);
+	}
+	return m;
+}
+
+void ImageSet::compensateIntensity(PixelArray &pixels) {
+	assert(lights3d.size() == size_t(images.size()));
+	size_t nlights = lights3d.size();
+	if(falloff_x.size() != size_t(image_width)*nlights || falloff_y.size() != size_t(image_height)*nlights)
+		buildFalloff();
+
+	int npixels = pixels.size();
+#pragma omp parallel for num_threads(decode_threads)
+	for(int k = 0; k < npixels; k++) {
+		Pixel pixel = pixels[k];
+		const float *fx = falloff_x.data() + size_t(pixel.x)*nlights;
+		const float *fy = falloff_y.data() + size_t(pixel.y)*nlights;
+		float *c = (float *)pixel.data();
+		for(size_t i = 0; i < nlights; i++) {
+			float di = fx[i] + fy[i];
+			c[i*3 + 0] *= di;
+			c[i*3 + 1] *= di;
+			c[i*3 + 2] *= di;
+		}
+	}
+}
+
+//return k sorted distinct integers from 0 to n-1, one for each of k strata (jittered).
+//with weights the strata are taken on the cumulative weight: more samples where the weight is higher.
+class StratifiedSampler {
 public:
-	set<uint32_t> res;
-	StupidSampler() { srand(0); }
-	set<uint32_t> &result(uint32_t k, uint32_t n) {
-		res.clear();
-		//res.insert(0);
-		while (res.size() < k)
-			res.insert(rand()%n);
+	std::vector<uint32_t> res;
+	StratifiedSampler(uint32_t seed = 0): state(seed*2654435761u + 1) {}
+
+	std::vector<uint32_t> &result(uint32_t k, uint32_t n) {
+		res.resize(k);
+		double step = double(n)/k;
+		for(uint32_t j = 0; j < k; j++)
+			res[j] = std::min(n - 1, uint32_t((j + random())*step));
+		//strata narrower than 2 might pick the same value twice.
+		distinct(n);
 		return res;
 	}
+
+	std::vector<uint32_t> &result(uint32_t k, uint32_t n, const std::vector<float> &weights) {
+		cdf.resize(n);
+		double total = 0.0;
+		for(uint32_t x = 0; x < n; x++)
+			total += weights[x];
+		//half of the samples are uniform: flat areas are not left out.
+		double floor = std::max(total/n, 1e-6);
+		total = 0.0;
+		for(uint32_t x = 0; x < n; x++)
+			cdf[x] = (total += weights[x] + floor);
+
+		res.resize(k);
+		double step = total/k;
+		uint32_t x = 0;
+		for(uint32_t j = 0; j < k; j++) {
+			double t = (j + random())*step;
+			while(x < n - 1 && cdf[x] <= t)
+				x++;
+			res[j] = x;
+		}
+		//heavy columns might be picked more than once.
+		distinct(n);
+		return res;
+	}
+
+protected:
+	uint32_t state;
+	std::vector<double> cdf;
+
+	//make the sorted res (k <= n) strictly increasing and in range.
+	void distinct(uint32_t n) {
+		uint32_t k = res.size();
+		for(uint32_t j = 1; j < k; j++)
+			res[j] = std::max(res[j], res[j-1] + 1);
+		for(int j = int(k) - 1; j >= 0; j--)
+			res[j] = std::min(res[j], j == int(k) - 1 ? n - 1 : res[j+1] - 1);
+	}
+
+	//xorshift, deterministic across platforms (unlike rand).
+	double random() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state/4294967296.0;
+	}
 };
 
-uint32_t ImageSet::sample(PixelArray &resample, uint32_t ndimensions, std::function<void(Pixel &, Pixel &)> resampler, uint32_t samplingram) {
+uint32_t ImageSet::sample(SampleArray &resample, uint32_t ndimensions, std::function<void(PixelArray &sample, PixelArray &resampled)> resampler, uint32_t samplingram,
+						  std::function<void(PixelArray &resampled)> consume) {
 	if(current_line == 0)
 		skipToTop();
 
-	uint32_t bytes_per_sample = ndimensions*12;
+	uint32_t bytes_per_sample = SampleArray::bytesPerSample(ndimensions, resample.bits);
 	uint32_t nsamples = samplingram*((1<<20)/bytes_per_sample);
 	
 	if(nsamples > (uint32_t)width*height)
 		nsamples = width*height;
 
-	uint32_t samplexrow = std::min((int)(nsamples/height), (int)(width/4));
-	nsamples = samplexrow*height;
+	//the per row budget is spread over the sampled rows, the others are skipped.
+	int nrows = sampling_rows > 0 ? std::min(sampling_rows, height) : height;
+	uint32_t samplexrow = std::min((int)(nsamples/nrows), width);
+	nsamples = samplexrow*nrows;
 	resample.resize(nsamples, ndimensions);
 
-	StupidSampler sampler;
+	StratifiedSampler sampler;
+	std::vector<uint32_t> rows = StratifiedSampler(1).result(nrows, height);
 	PixelArray sample(samplexrow, lights.size());
+	PixelArray resampled(samplexrow, ndimensions);
+	std::vector<float> weights(width);
 
 	uint32_t offset = 0;
-	vector<uint8_t> row(image_width*3);
-	for(int y = top; y < bottom; y++) {
-		if(callback && !(*callback)(std::string("Sampling images:"), 100*(y-top)/(height-1)))
+	size_t rowsize = decoders[0]->rowSize();
+	band.resize(decoders.size()*rowsize);
+	int nimages = decoders.size();
+	int next = top; //next row of the decoders
+	for(int r = 0; r < nrows; r++) {
+		if(callback && !(*callback)(std::string("Sampling images:"), 100*r/nrows))
 			throw std::string("Cancelled");
 
+		int y = top + rows[r];
 		//read one row per image at a time
-		auto &selection = sampler.result(samplexrow, width);
-
-		for(uint32_t i = 0; i < decoders.size(); i++) {
-			JpegDecoder *dec = decoders[i];
-			dec->readRows(1, row.data());
-			uint32_t x = 0;
-			for(int k: selection) {
-				Color3f &pixel = sample[x][i];
-
-				pixel.r = row[(k+left)*3 + 0];
-				pixel.g = row[(k+left)*3 + 1];
-				pixel.b = row[(k+left)*3 + 2];
-				x++;
+		if(!cache_data) {
+			//rows are strictly increasing: the decoders only move forward.
+			int skip = y - next;
+			assert(skip >= 0);
+#pragma omp parallel for schedule(dynamic) num_threads(decode_threads)
+			for(int i = 0; i < nimages; i++) {
+				if(skip > 0)
+					decoders[i]->skipRows(skip);
+				decoders[i]->readRows(1, band.data() + i*rowsize);
 			}
+			next = y + 1;
+			//the cache needs all the rows, it will be written in the next full pass.
+			if(nrows == height)
+				writeCache(1);
 		}
-
-
-		//compensate intensity.
-		if(light3d) {
-
-			uint32_t x = 0;
-			for(int k: selection) {
-				sample[x].x = k + left;
-				sample[x].y = image_height - 1 - y;
-				x++;
-			}
-
-			for(Pixel &pixel: sample) {
-				for(size_t i = 0; i < lights3d.size(); i++) {
-					Vector3f l = relativeLight(lights3d[i], pixel.x, pixel.y);
-					float r = l.squaredNorm();
-					//TODO precompute
-					float di = r / (dome_radius*dome_radius);
-					pixel[i].r *= di;
-					pixel[i].g *= di;
-					pixel[i].b *= di;
+		//pixel x of image i is row(i)[x*stride]
+		size_t stride = cache_data ? nimages*3 : 3;
+		auto row = [&](int i) -> const uint8_t * {
+			if(cache_data)
+				return cacheRow(y - top) + i*3;
+			return band.data() + i*rowsize + (left - crop_x)*3;
+		};
+
+		if(importance_sampling) {
+			//luminance variance across the lights.
+#pragma omp parallel for num_threads(decode_threads)
+			for(int x = 0; x < width; x++) {
+				double m = 0.0, m2 = 0.0;
+				for(int i = 0; i < nimages; i++) {
+					const uint8_t *p = row(i) + x*stride;
+					double l = (p[0] + p[1] + p[2])/3.0;
+					m += l;
+					m2 += l*l;
 				}
+				m /= nimages;
+				weights[x] = float(std::max(0.0, m2/nimages - m*m));
+			}
+		}
+		auto &selection = importance_sampling ? sampler.result(samplexrow, width, weights) : sampler.result(samplexrow, width);
+
+#pragma omp parallel for num_threads(decode_threads)
+		for(int i = 0; i < nimages; i++) {
+			const uint8_t *r = row(i);
+			LightSlice light = sample.light(i);
+			for(uint32_t x = 0; x < samplexrow; x++) {
+				const uint8_t *p = r + selection[x]*stride;
+				Color3f &pixel = light[x];
+				pixel.r = p[0];
+				pixel.g = p[1];
+				pixel.b = p[2];
 			}
 		}
 
-		for(uint32_t x = 0; x < selection.size(); x++)
-			resampler(sample[x], resample[offset + x]);
+		for(uint32_t x = 0; x < samplexrow; x++) {
+			Pixel pixel = sample[x];
+			pixel.x = selection[x] + left;
+			pixel.y = image_height - 1 - y;
+		}
+
+		if(light3d)
+			compensateIntensity(sample);
+
+		resampler(sample, resampled);
+		for(uint32_t x = 0; x < samplexrow; x++)
+			resample.store(offset + x, resampled[x]);
+		if(consume)
+			consume(resampled);
 
 		offset += samplexrow;
 	}
@@ -406,22 +677,134 @@ uint32_t ImageSet::sample(PixelArray &resample, uint32_t ndimensions, std::funct
 }
 
 void ImageSet::restart() {
-	for(uint32_t i = 0; i < decoders.size(); i++)
-		decoders[i]->restart();
-	
+	//the decoders are not used when reading from the cache.
+	if(!cache_data)
+		restartDecoders();
 	current_line = 0;
 }
 
-void ImageSet::skipToTop() {
-	std::vector<uint8_t> row(image_width*3);
+void ImageSet::restartDecoders() {
+	int nimages = decoders.size();
+#pragma omp parallel for num_threads(decode_threads)
+	for(int i = 0; i < nimages; i++)
+		decoders[i]->restart();
+}
 
-	for(uint32_t i = 0; i < decoders.size(); i++) {
-		for(int y = 0; y < top; y++)
-			decoders[i]->readRows(1, row.data());
-		
-		if(callback && !(*callback)(std::string("Skipping cropped lines..."), 100*i/(decoders.size()-1)))
-			throw std::string("Cancelled");
+void ImageSet::skipToTop() {
+	//lights, crop or dome might have changed since the last pass.
+	if(light3d)
+		buildFalloff();
+	openCache();
+	if(cache_data) {
+		current_line += top;
+		return;
 	}
+	//skipped rows are not color converted nor upsampled.
+	int nimages = decoders.size();
+#pragma omp parallel for schedule(dynamic) num_threads(decode_threads)
+	for(int i = 0; i < nimages; i++)
+		decoders[i]->skipRows(top);
+
+	if(top && callback && !(*callback)(std::string("Skipping cropped lines..."), 100))
+		throw std::string("Cancelled");
 	current_line += top;
 }
 
+struct CacheHeader {
+	char magic[4] = { 'R', 'L', 'C', '1' };
+	int32_t image_width = 0, image_height = 0;
+	int32_t left = 0, top = 0, width = 0, height = 0;
+	int32_t nimages = 0;
+	int32_t scale = 1;
+	uint32_t signature = 0;
+	uint32_t complete = 0;
+};
+
+void ImageSet::openCache() {
+	if(cache_path.isEmpty() || cache_data)
+		return;
+
+	CacheHeader header;
+	header.image_width = image_width;
+	header.image_height = image_height;
+	header.left = left;
+	header.top = top;
+	header.width = width;
+	header.height = height;
+	header.nimages = decoders.size();
+	header.scale = scale;
+	header.signature = signature;
+
+	if(!cache) {
+		cache = new QFile(cache_path);
+		if(!cache->open(QFile::ReadWrite)) {
+			cerr << "Could not open cache file: " << qPrintable(cache_path) << endl;
+			closeCache();
+			cache_path.clear();
+			return;
+		}
+		CacheHeader stored;
+		if(cache->read((char *)&stored, sizeof(stored)) == sizeof(stored) && stored.complete) {
+			stored.complete = 0;
+			qint64 size = sizeof(header) + qint64(height)*width*decoders.size()*3;
+			if(memcmp(&stored, &header, sizeof(header)) == 0 && cache->size() == size) {
+				cache_data = cache->map(sizeof(header), size - sizeof(header));
+				if(cache_data)
+					return;
+			}
+		}
+	}
+	//(re)start writing the cache from the first row.
+	cache->resize(0);
+	cache->seek(0);
+	cache->write((char *)&header, sizeof(header));
+	cache_rows = 0;
+}
+
+void ImageSet::closeCache() {
+	if(cache)
+		delete cache; //unmaps the data too.
+	cache = nullptr;
+	cache_data = nullptr;
+	cache_rows = 0;
+}
+
+void ImageSet::writeCache(int nrows) {
+	if(!cache || cache_data)
+		return;
+
+	size_t rowsize = decoders[0]->rowSize();
+	int nimages = decoders.size();
+	std::vector<uint8_t> rows(size_t(nrows)*width*nimages*3);
+#pragma omp parallel for num_threads(decode_threads)
+	for(int i = 0; i < nimages; i++) {
+		for(int r = 0; r < nrows; r++) {
+			const uint8_t *src = band.data() + (size_t(i)*nrows + r)*rowsize + (left - crop_x)*3;
+			uint8_t *dst = rows.data() + (size_t(r)*width*nimages + i)*3;
+			for(int x = 0; x < width; x++) {
+				dst[x*nimages*3 + 0] = src[x*3 + 0];
+				dst[x*nimages*3 + 1] = src[x*3 + 1];
+				dst[x*nimages*3 + 2] = src[x*3 + 2];
+			}
+		}
+	}
+	if(cache->write((char *)rows.data(), rows.size()) != qint64(rows.size())) {
+		cerr << "Failed writing cache file: " << qPrintable(cache_path) << endl;
+		closeCache();
+		cache_path.clear();
+		return;
+	}
+	cache_rows += nrows;
+	if(cache_rows < height)
+		return;
+
+	//complete: mark it and use it from now on.
+	CacheHeader header;
+	cache->seek(0);
+	cache->read((char *)&header, sizeof(header));
+	header.complete = 1;
+	cache->seek(0);
+	cache->write((char *)&header, sizeof(header));
+	cache->flush();
+	cache_data = cache->map(sizeof(header), cache->size() - sizeof(header));
+}
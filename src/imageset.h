@@ -12,6 +12,7 @@
 class QJsonObject;
 class JpegDecoder;
 class QImage;
+class QFile;
 
 class ImageSet {
 public:
@@ -26,6 +27,14 @@ public:
 	float dome_radius = 4.0f;
 	float vertical_offset = 0.0f;
 	bool light3d = false;
+	int decode_threads = 8; //images are decoded concurrently in readLine and sample
+	int ring_size = 2;      //number of bands returned by readBand which stay valid
+	int scale = 1;          //images are decoded at 1/scale resolution (1, 2, 4 or 8), set before initImages.
+	bool in_memory = false; //decode from memory mapped images (read in RAM on windows): no open file per image.
+	bool importance_sampling = false; //sample more pixels where the luminance changes more across the lights.
+	int sampling_rows = 0;            //rows decoded by sample, the others are skipped, 0 for all.
+	//optional light stack cache: written during the first full pass, memory mapped and used instead of the decoders afterwards.
+	QString cache_path;
     QString path;
 
 	
@@ -45,21 +54,65 @@ public:
 	bool initImages(const char *path); //require lights and images to be available, path points to the dir of the images.
 	
 	QImage maxImage(std::function<bool(std::string stage, int percent)> *callback = nullptr); 
-	void crop(int _left, int _top, int _right, int _bottom);
+	//crop is in full resolution image coordinates.
+	void crop(int _left, int _top, int _width, int _height);
 	void setCallback(std::function<bool(std::string stage, int percent)> *_callback = nullptr) { callback = _callback; }
 	//call AFTER initImages and BEFORE breadline, decode or sample.
 
 	void decode(size_t img, unsigned char *buffer);
 	void readLine(PixelArray &line);
-	uint32_t sample(PixelArray &sample, uint32_t ndimensions, std::function<void(Pixel &, Pixel &)> resampler, uint32_t samplingrate);
+	//read nrows (less at the bottom of the image) into the next band of the ring: pixels are ordered by row.
+	//the band is overwritten after ring_size calls.
+	PixelArray &readBand(int nrows);
+	//skip nrows (the cache is not written in this pass).
+	void skipRows(int nrows);
+	//resample.bits sets the storage (and memory budget) of the samples.
+	//resampler converts each row of samples at once.
+	//consume (optional) gets the resampled pixels of each row as they are sampled.
+	uint32_t sample(SampleArray &resample, uint32_t ndimensions, std::function<void(PixelArray &sample, PixelArray &resampled)> resampler, uint32_t samplingrate,
+					std::function<void(PixelArray &resampled)> consume = nullptr);
 	void restart();
 	void skipToTop();
 
 	Vector3f relativeLight(const Vector3f &light, int x, int y);
+	//largest factor applied by compensateIntensity over the image, 1 for directional lights.
+	float maxFalloff();
 
 protected:
 	std::function<bool(std::string stage, int percent)> *callback;
 	std::vector<JpegDecoder *> decoders;
+	//compressed images when in_memory: memory mapped (the files are closed), read in RAM on windows.
+	struct Source {
+		uint8_t *data = nullptr;
+		size_t size = 0;
+	};
+	std::vector<Source> sources;
+	std::vector<uint8_t> band; //decoded rows for all images: image, row, pixel.
+	std::vector<PixelArray> ring;
+	size_t ring_pos = 0;
+	//decoders only decode the cropped columns, rows start at crop_x (aligned to the jpeg blocks, <= left).
+	int crop_x = 0;
+
+	//cache layout: cropped rows, for each pixel all the lights, rgb uint8.
+	QFile *cache = nullptr;
+	uint8_t *cache_data = nullptr; //mapped when the cache is complete
+	int cache_rows = 0;            //rows written in the current pass
+	uint32_t signature = 0;        //identifies the images (name, size, date)
+
+	void readRows(PixelArray &pixels, int nrows);
+	void restartDecoders();
+	void openCache();
+	void closeCache();
+	//append the nrows decoded in band to the cache.
+	void writeCache(int nrows);
+	uint8_t *cacheRow(int y) { return cache_data + size_t(y)*width*decoders.size()*3; }
+
+	//positional lights: the squared distance of pixel x, y from light i (over the dome radius squared)
+	//is falloff_x[x*nlights + i] + falloff_y[y*nlights + i], full image coordinates.
+	std::vector<float> falloff_x, falloff_y;
+	void buildFalloff();
+	//multiply the pixels by the falloff of each light.
+	void compensateIntensity(PixelArray &pixels);
 };
 
 #endif // IMAGESET_H
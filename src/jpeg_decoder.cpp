@@ -1,5 +1,7 @@
 #include "jpeg_decoder.h"
 
+#include <algorithm>
+
 JpegDecoder::JpegDecoder() {
 	decInfo.err = jpeg_std_error(&errMgr);
 	jpeg_create_decompress(&decInfo);
@@ -52,7 +54,7 @@ bool JpegDecoder::decode(FILE *file, uint8_t*& img, int& width, int& height) {
 bool JpegDecoder::decode(uint8_t*& img, int& width, int& height) {
 	init(width, height);
 
-	img = new uint8_t[decInfo.image_height * rowSize()];
+	img = new uint8_t[decInfo.output_height * rowSize()];
 
 	int readed = readRows(height, img);
 	if(readed != height)
@@ -76,42 +78,78 @@ bool JpegDecoder::init(const char* path, int &width, int &height) {
 	return init(width, height);
 }
 
+bool JpegDecoder::init(uint8_t *buffer, size_t len, int &width, int &height) {
+	mem = buffer;
+	mem_len = len;
+	jpeg_mem_src(&decInfo, mem, mem_len);
+	return init(width, height);
+}
+
 bool JpegDecoder::init(int &width, int &height) {
 	jpeg_read_header(&decInfo, (boolean)true);
 	//decInfo.out_color_space = colorSpace;
 	//decInfo.jpeg_color_space = jpegColorSpace;
 	decInfo.raw_data_out = (boolean)false;
+	decInfo.scale_num = 1;
+	decInfo.scale_denom = scale_denom;
 	
 	if(decInfo.num_components > 1) 
 		subsampled =  decInfo.comp_info[1].h_samp_factor != 1;
 
 	jpeg_start_decompress(&decInfo);
 
-	width = decInfo.image_width;
-	height = decInfo.image_height;
+	width = decInfo.output_width;
+	height = decInfo.output_height;
+
+	crop_x = 0;
+	if(crop_width > 0 && crop_width < int(decInfo.output_width)) {
+		JDIMENSION x = crop_left;
+		JDIMENSION w = crop_width;
+		jpeg_crop_scanline(&decInfo, &x, &w);
+		crop_x = x;
+	}
 	return true;
 }
 
 size_t JpegDecoder::readRows(int nrows, uint8_t *buffer) { //return false on end.
-	if(decInfo.output_scanline == decInfo.image_height)
+	if(decInfo.output_scanline == decInfo.output_height)
 		restart();
 
-	size_t rowSize = decInfo.image_width * decInfo.num_components;
 	JSAMPROW rows[1];
 	size_t offset = 0;
 	int readed = 0;
-	while (decInfo.output_scanline < decInfo.image_height && readed < nrows) {
+	while (decInfo.output_scanline < decInfo.output_height && readed < nrows) {
 		readed++;
 		rows[0] = buffer + offset;
 		jpeg_read_scanlines(&decInfo, rows, 1);
-		offset += rowSize;
+		offset += rowSize();
 	}
 
-	if(decInfo.output_scanline == decInfo.image_height)
+	if(decInfo.output_scanline == decInfo.output_height)
 		jpeg_finish_decompress(&decInfo);
 	return readed;
 }
 
+size_t JpegDecoder::skipRows(int nrows) {
+	//a negative count would become a huge JDIMENSION and skip to the end.
+	if(nrows <= 0)
+		return 0;
+	if(decInfo.output_scanline == decInfo.output_height)
+		restart();
+
+	nrows = std::min<JDIMENSION>(nrows, decInfo.output_height - decInfo.output_scanline);
+	size_t skipped = jpeg_skip_scanlines(&decInfo, nrows);
+
+	if(decInfo.output_scanline == decInfo.output_height)
+		jpeg_finish_decompress(&decInfo);
+	return skipped;
+}
+
+void JpegDecoder::setCrop(int x, int width) {
+	crop_left = x;
+	crop_width = width;
+}
+
 bool JpegDecoder::finish() {
 	if(file)
 		fclose(file);
@@ -121,8 +159,11 @@ bool JpegDecoder::finish() {
 bool JpegDecoder::restart() {
 	//jpeg_finish_decompress(&decInfo);
 	jpeg_abort_decompress(&decInfo);
-	rewind(file);
-	jpeg_stdio_src(&decInfo, file);
+	if(file) {
+		rewind(file);
+		jpeg_stdio_src(&decInfo, file);
+	} else
+		jpeg_mem_src(&decInfo, mem, mem_len);
 	int w, h;
 	return init(w, h);
 }
@@ -25,19 +25,34 @@ public:
 	bool decode(const char* path, uint8_t*& img, int& width, int& height);
 	bool decode(FILE* file, uint8_t*& img, int& width, int& height);
 
-	//file streaming reading support
+	//decode at 1/denom resolution (1, 2, 4 or 8) using the DCT scaling, must be called before init.
+	void setScale(int denom) { scale_denom = denom; }
+
+	//file streaming reading support, width and height are the (scaled) output size.
 	bool init(const char* path, int &width, int &height);
+	//streaming from a compressed image in memory, buffer must stay valid until the decoder is destroyed.
+	bool init(uint8_t *buffer, size_t len, int &width, int &height);
 
-	size_t rowSize() { return decInfo.image_width * decInfo.num_components; }
+	size_t rowSize() { return decInfo.output_width * decInfo.output_components; }
 
 	//buffer must have rows*rowSize() space at least!
 	size_t readRows(int rows, uint8_t *buffer); //return false on end.
+	//skip rows without color conversion and upsampling, return the number of rows skipped.
+	size_t skipRows(int rows);
+
+	//decode only columns [x, x + width), applied on init and restart (width 0 disables).
+	//libjpeg aligns x to the iMCU boundary: the decoded columns start at cropX() and are outputWidth() wide.
+	void setCrop(int x, int width);
+	int cropX() { return crop_x; }
+	int outputWidth() { return decInfo.output_width; }
 	bool finish();
 	bool restart();
 	bool chromaSubsampled() { return subsampled; }
 
 private:
 	FILE *file = nullptr;
+	uint8_t *mem = nullptr;
+	size_t mem_len = 0;
 	bool init(int &width, int &height);
 	bool decode(uint8_t*& img, int& width, int& height);
 
@@ -45,6 +60,9 @@ private:
 	jpeg_error_mgr errMgr;
 
 	bool subsampled = false;
+	int scale_denom = 1;
+	int crop_x = 0;
+	int crop_left = 0, crop_width = 0; //requested crop
 };
 
 #endif // JPEGDECODER_H_
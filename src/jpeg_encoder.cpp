@@ -1,7 +1,9 @@
 #include "jpeg_encoder.h"
 
 #include <cmath>
+#include <algorithm>
 #include <iostream>
+#include <assert.h>
 using namespace std;
 
 JpegEncoder::JpegEncoder() {
@@ -11,6 +13,9 @@ JpegEncoder::JpegEncoder() {
 
 JpegEncoder::~JpegEncoder() {
 	jpeg_destroy_compress(&info);
+	if(file) //not finished.
+		fclose(file);
+	free(mem);
 }
 
 void JpegEncoder::setColorSpace(J_COLOR_SPACE colorSpace, int numComponents) {
@@ -50,6 +55,10 @@ void JpegEncoder::setDotsPerMeter(float dotsPerMeter) {
         this->dotsPerCM = round( dotsPerMeter / 100.0 );  // JPEG requires a resolution in pixels/cm
 }
 
+void JpegEncoder::setThreads(int threads) {
+	this->threads = std::max(1, threads);
+}
+
 
 bool JpegEncoder::encode(uint8_t* img, int width, int height, FILE* file) {
 	if (file == nullptr)
@@ -79,30 +88,7 @@ bool JpegEncoder::encode(uint8_t* img, int width, int height, uint8_t *&buffer,
 }
 
 bool JpegEncoder::encode(uint8_t* img, int width, int height) {
-	info.image_width = width;
-	info.image_height = height;
-	info.in_color_space = colorSpace;
-	info.input_components = numComponents;
-
-	jpeg_set_defaults(&info);
-	jpeg_set_colorspace(&info, jpegColorSpace);
-	jpeg_set_quality(&info, quality, (boolean)true);
-	info.optimize_coding = (boolean)optimize;
-
-	// Set our output resolution if provided in pixels/cm
-	if(dotsPerCM>0) {
-	        info.X_density = dotsPerCM;
-		info.Y_density = dotsPerCM;
-		info.density_unit = 2;   // 2 = pixels per cm
-	}
-
-	if(jpegColorSpace == JCS_YCbCr && subsample == false) {
-		for(int i = 0; i < numComponents; i++) {
-			info.comp_info[i].h_samp_factor = 1;
-			info.comp_info[i].v_samp_factor = 1;
-		}
-	}
-
+	setup(info, width, height);
 	jpeg_start_compress(&info, (boolean)true);
 
 	writeRows(img, height);
@@ -125,35 +111,81 @@ bool JpegEncoder::init(const char* path, int width, int height) {
 	return init(width, height);
 }
 
-bool JpegEncoder::init(int width, int height) {
-	info.image_width = width;
-	info.image_height = height;
-	info.in_color_space = colorSpace;
-	info.input_components = numComponents;
+bool JpegEncoder::initMemory(int width, int height) {
+	memory = true;
+	free(mem);
+	mem = nullptr;
+	mem_size = 0;
+	jpeg_mem_dest(&info, &mem, &mem_size);
+	return init(width, height);
+}
+
+void JpegEncoder::setup(jpeg_compress_struct &cinfo, int width, int height) {
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.in_color_space = colorSpace;
+	cinfo.input_components = numComponents;
 
-	jpeg_set_defaults(&info);
-	jpeg_set_colorspace(&info, jpegColorSpace);
-	jpeg_set_quality(&info, quality, (boolean)true);
-	info.optimize_coding = (boolean)optimize;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_colorspace(&cinfo, jpegColorSpace);
+	jpeg_set_quality(&cinfo, quality, (boolean)true);
+	cinfo.optimize_coding = (boolean)optimize;
 
 	// Set our output resolution if provided in pixels/cm
 	if(dotsPerCM>0) {
-	        info.X_density = dotsPerCM;
-		info.Y_density = dotsPerCM;
-		info.density_unit = 2;   // 2 = pixels per cm
+	        cinfo.X_density = dotsPerCM;
+		cinfo.Y_density = dotsPerCM;
+		cinfo.density_unit = 2;   // 2 = pixels per cm
 	}
 
 	if(jpegColorSpace == JCS_YCbCr && subsample == false)
 		for(int i = 0; i < numComponents; i++) {
-			info.comp_info[i].h_samp_factor = 1;
-			info.comp_info[i].v_samp_factor = 1;
+			cinfo.comp_info[i].h_samp_factor = 1;
+			cinfo.comp_info[i].v_samp_factor = 1;
 		}
+}
+
+bool JpegEncoder::init(int width, int height) {
+	this->width = width;
+	this->height = height;
+	setup(info, width, height);
+
+	//a stripe is a whole number of MCU rows and a single restart interval (at most 65535 MCUs).
+	stripe_rows = 0;
+	if(threads > 1) {
+		int hmax = 1, vmax = 1;
+		if(info.num_components > 1) {
+			for(int i = 0; i < info.num_components; i++) {
+				hmax = std::max(hmax, info.comp_info[i].h_samp_factor);
+				vmax = std::max(vmax, info.comp_info[i].v_samp_factor);
+			}
+		}
+		int mcus_per_row = (width + 8*hmax - 1)/(8*hmax);
+		int mcu_rows = std::min(256/(8*vmax), 65535/mcus_per_row);
+		if(mcu_rows > 0 && height > mcu_rows*8*vmax) {
+			stripe_rows = mcu_rows*8*vmax;
+			restart_interval = mcu_rows*mcus_per_row;
+			pending.resize(size_t(stripe_rows)*width*numComponents);
+			pending_rows = 0;
+			stripes.clear();
+			return true;
+		}
+	}
 
 	jpeg_start_compress(&info, (boolean)true);
 	return true;
 }
 
 bool JpegEncoder::writeRows(uint8_t *rows, int n) {
+	if(stripe_rows) {
+		size_t rowSize = size_t(width)*numComponents;
+		for(int r = 0; r < n; r++) {
+			std::copy(rows + r*rowSize, rows + (r+1)*rowSize, pending.data() + pending_rows*rowSize);
+			if(++pending_rows == stripe_rows)
+				flushStripe();
+		}
+		return true;
+	}
 	int written = 0;
 	int rowSize = info.image_width * info.input_components;
 
@@ -165,13 +197,111 @@ bool JpegEncoder::writeRows(uint8_t *rows, int n) {
 	return true;
 }
 
+void JpegEncoder::flushStripe() {
+	//at most threads stripes are being compressed.
+	if(stripes.size() >= size_t(threads))
+		stripes[stripes.size() - threads].wait();
+	//the filled buffer is moved into the task, a new one is allocated for the next stripe.
+	size_t rowSize = size_t(width)*numComponents;
+	std::vector<uint8_t> rows;
+	rows.swap(pending);
+	rows.resize(size_t(pending_rows)*rowSize);
+	int nrows = pending_rows;
+	stripes.push_back(std::async(std::launch::async, [this, nrows](const std::vector<uint8_t> &rows) { return encodeStripe(rows, nrows); }, std::move(rows)));
+	pending.resize(size_t(stripe_rows)*rowSize);
+	pending_rows = 0;
+}
+
+std::vector<uint8_t> JpegEncoder::encodeStripe(const std::vector<uint8_t> &rows, int nrows) {
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr err;
+	cinfo.err = jpeg_std_error(&err);
+	jpeg_create_compress(&cinfo);
+	unsigned char *mem = nullptr;
+	unsigned long mem_size = 0;
+	jpeg_mem_dest(&cinfo, &mem, &mem_size);
+
+	//the same tables in every stripe, the interval is never complete before the end of the stripe.
+	setup(cinfo, width, nrows);
+	cinfo.optimize_coding = (boolean)false;
+	cinfo.restart_interval = restart_interval;
+	jpeg_start_compress(&cinfo, (boolean)true);
+	size_t rowSize = size_t(width)*numComponents;
+	for(int r = 0; r < nrows; r++) {
+		JSAMPROW row = (JSAMPROW)rows.data() + r*rowSize;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	std::vector<uint8_t> stripe(mem, mem + mem_size);
+	free(mem);
+	jpeg_destroy_compress(&cinfo);
+	return stripe;
+}
+
+size_t JpegEncoder::finishStripes() {
+	if(pending_rows)
+		flushStripe();
+
+	//headers of the first stripe (with the total height), then the scans separated by RSTn markers.
+	std::vector<uint8_t> jpeg;
+	for(size_t s = 0; s < stripes.size(); s++) {
+		std::vector<uint8_t> stripe = stripes[s].get();
+		size_t pos = 2; //after SOI
+		size_t sof = 0;
+		while(pos + 4 <= stripe.size()) {
+			uint8_t marker = stripe[pos + 1];
+			size_t length = (stripe[pos + 2] << 8) | stripe[pos + 3];
+			//any SOFn (not DHT, JPG or DAC): the frame height is at the same offset.
+			if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+				sof = pos;
+			pos += 2 + length;
+			if(marker == 0xDA)
+				break;
+		}
+		if(s == 0) {
+			assert(sof != 0);
+			jpeg.assign(stripe.begin(), stripe.begin() + pos);
+			jpeg[sof + 5] = uint8_t(height >> 8);
+			jpeg[sof + 6] = uint8_t(height & 0xff);
+		}
+		jpeg.insert(jpeg.end(), stripe.begin() + pos, stripe.end() - 2); //without EOI
+		if(s + 1 < stripes.size()) {
+			jpeg.push_back(0xFF);
+			jpeg.push_back(uint8_t(0xD0 + s%8));
+		}
+	}
+	jpeg.push_back(0xFF);
+	jpeg.push_back(0xD9);
+	stripes.clear();
+	stripe_rows = 0;
+
+	size_t size = 0;
+	if(file) {
+		fwrite(jpeg.data(), 1, jpeg.size(), file);
+		size = ftell(file);
+		fclose(file);
+		file = nullptr;
+	} else if(memory) {
+		free(mem);
+		mem = (unsigned char *)malloc(jpeg.size());
+		std::copy(jpeg.begin(), jpeg.end(), mem);
+		mem_size = jpeg.size();
+		size = mem_size;
+	}
+	return size;
+}
+
 size_t JpegEncoder::finish() {
+	if(stripe_rows)
+		return finishStripes();
 	jpeg_finish_compress(&info);
 	size_t size = 0;
 	if(file) {
 		size = ftell(file);
 		fclose(file);
-	}
+		file = nullptr;
+	} else if(memory)
+		size = mem_size;
 	return size;
 }
 
@@ -4,6 +4,8 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstdint>
+#include <vector>
+#include <future>
 
 #include <jpeglib.h>
 
@@ -25,22 +27,35 @@ public:
 	void setOptimize(bool optimize);
 	void setChromaSubsampling(bool subsample);
         void setDotsPerMeter(float dotsPerMeter);
+	//init, writeRows and finish compress stripes of rows in parallel, joined with restart markers.
+	//stripes use the standard huffman tables (no optimization), 1 compresses sequentially.
+	void setThreads(int threads);
 
 	bool encode(uint8_t *img, int width, int height, FILE* file);
 	bool encode(uint8_t *img, int width, int height, const char* path);
 	bool encode(uint8_t *img, int width, int height, uint8_t *&buffer, int &length);
 
 	bool init(const char* path, int width, int height);
+	//compressed in memory, data() is valid after finish and until the encoder is destroyed.
+	bool initMemory(int width, int height);
 	bool writeRows(uint8_t *rows, int n);
 	size_t finish(); //return size
+	const uint8_t *data() const { return mem; }
 
 private:
 	bool init(int width, int height);
 	bool encode(uint8_t* img, int width, int height);
+	void setup(jpeg_compress_struct &cinfo, int width, int height);
+	std::vector<uint8_t> encodeStripe(const std::vector<uint8_t> &rows, int nrows);
+	void flushStripe();
+	size_t finishStripes();
 	static void onError(j_common_ptr cinfo);
 	static void onMessage(j_common_ptr cinfo);
 
 	FILE * file = nullptr;
+	bool memory = false;
+	unsigned char *mem = nullptr;
+	unsigned long mem_size = 0;
 	jpeg_compress_struct info;
 	jpeg_error_mgr errMgr;
 
@@ -52,6 +67,15 @@ private:
 
 	int quality = 95;
         int dotsPerCM = 0;
+
+	int threads = 1;
+	int width = 0;
+	int height = 0;
+	int stripe_rows = 0;      //0 if not using stripes
+	int restart_interval = 0; //MCUs in a stripe
+	std::vector<uint8_t> pending; //rows of the stripe being filled
+	int pending_rows = 0;
+	std::vector<std::future<std::vector<uint8_t>>> stripes;
 };
 
 #endif // JPEGENCODER_H_
@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <stddef.h>
 #include <math.h>
+#include <string.h>
 #include <vector>
 
 
@@ -143,37 +144,168 @@ typedef Color3<double>  Color3d;
 
 
 //a Pixel is the collection of N lights intensity.
-//pixel array is organized by pixel:
+//it is a view on the PixelArray storage: the N colors are contiguous,
+//x and y refer to the position stored in the array.
+class Pixel {
+public:
+	int &x, &y;
+
+	Pixel(Color3f *_colors, uint32_t _nlights, int &_x, int &_y):
+		x(_x), y(_y), colors(_colors), nlights(_nlights) {}
+
+	Color3f &operator[](size_t k) const { return colors[k]; }
+	Color3f *data() const { return colors; }
+	size_t size() const { return nlights; }
+	Color3f *begin() const { return colors; }
+	Color3f *end() const { return colors + nlights; }
+
+private:
+	Color3f *colors;
+	uint32_t nlights;
+};
+
+//a LightSlice is the intensity of a single light across all the pixels of a PixelArray (strided view).
+class LightSlice {
+public:
+	LightSlice(Color3f *_colors, uint32_t _stride, uint32_t _npixels):
+		colors(_colors), stride(_stride), npixels(_npixels) {}
+
+	Color3f &operator[](size_t i) const { return colors[i*stride]; }
+	size_t size() const { return npixels; }
+
+private:
+	Color3f *colors;
+	uint32_t stride;
+	uint32_t npixels;
+};
+
+//pixel array is organized by pixel in a single contiguous buffer:
 //pixel0: light1, light2 ... light n;
 //then pixel1: etc etc.
-class Pixel: public std::vector<Color3f> {
+class PixelArray {
 public:
-	int x, y;
-	float intensity;
+	uint32_t nlights = 0;
+
+	class iterator {
+	public:
+		iterator(PixelArray *_array, size_t _i): array(_array), i(_i) {}
+		Pixel operator*() const { return (*array)[i]; }
+		iterator &operator++() { i++; return *this; }
+		bool operator!=(const iterator &it) const { return i != it.i; }
+	private:
+		PixelArray *array;
+		size_t i;
+	};
+
+	PixelArray(size_t n = 0, size_t k = 0) {
+		resize(n, k);
+	}
+	//memory is reused: no reallocation if the array does not grow.
+	void resize(size_t n, size_t k) {
+		nlights = k;
+		colors.resize(n*k);
+		xs.resize(n);
+		ys.resize(n);
+	}
+	uint32_t components() const { return nlights; }
+	uint32_t npixels() const { return xs.size(); }
+	size_t size() const { return xs.size(); }
+
+	Pixel operator[](size_t i) { return Pixel(colors.data() + i*nlights, nlights, xs[i], ys[i]); }
+	Pixel pixel(size_t i) { return (*this)[i]; }
+	LightSlice light(size_t k) { return LightSlice(colors.data() + k, nlights, npixels()); }
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, size()); }
+
+	//get ith sample, k light.
+	Color3f &operator()(size_t i, size_t k) { return colors[i*nlights + k]; }
+	Color3f *data() { return colors.data(); }
+	float *rawdata() { return (float *)colors.data(); }
+
+protected:
+	std::vector<Color3f> colors;
+	std::vector<int> xs, ys;
 };
 
-class PixelArray: public std::vector<Pixel> {
+//compact storage for the sampled pixels: each channel is kept in 8 or 16 bits (fixed point) or as float.
+//samples are converted on the fly into a PixelArray when consumed.
+class SampleArray {
 public:
-	uint32_t nlights;
+	uint32_t nlights = 0;
+	int bits = 32;     //8, 16 or 32 (float)
+	float scale = 1.0;  //stored value = (value + offset)*scale
+	float offset = 0.0; //16 bits allow for negative (ycc) and intensity compensated values above 255.
 
-	PixelArray(size_t n = 0, size_t k = 0): nlights(k) {
-		resize(n, k);
+	SampleArray(int _bits = 32): bits(_bits) {
+		if(bits == 16) {
+			scale = 32.0f;
+			offset = 512.0f;
+		}
+	}
+	static size_t bytesPerSample(size_t k, int bits) { return k*3*(bits/8); }
+	//16 bits: widen the default range [-512, 1536) to hold values up to high (same proportions, coarser step).
+	void setRange(float high) {
+		if(bits != 16 || high <= 1536.0f)
+			return;
+		offset = high/3.0f;
+		scale = 65535.0f/(offset + high);
 	}
+
 	void resize(size_t n, size_t k) {
 		nlights = k;
-		std::vector<Pixel>::resize(n);
-		for(auto &pixel: *this)
-			pixel.resize(nlights);
+		buffer.resize(n*bytesPerSample(k, bits));
+		xs.resize(n);
+		ys.resize(n);
+	}
+	uint32_t components() const { return nlights; }
+	uint32_t npixels() const { return xs.size(); }
+	size_t size() const { return xs.size(); }
+
+	void store(size_t i, Pixel pixel) {
+		xs[i] = pixel.x;
+		ys[i] = pixel.y;
+		size_t n = nlights*3;
+		const float *src = (const float *)pixel.data();
+		switch(bits) {
+		case 8:  pack(src, buffer.data() + i*n, n, 255.0f); break;
+		case 16: pack(src, (uint16_t *)buffer.data() + i*n, n, 65535.0f); break;
+		default: memcpy((float *)buffer.data() + i*n, src, n*sizeof(float));
+		}
+	}
+	void load(size_t i, Pixel pixel) {
+		pixel.x = xs[i];
+		pixel.y = ys[i];
+		size_t n = nlights*3;
+		float *dst = (float *)pixel.data();
+		switch(bits) {
+		case 8:  unpack(buffer.data() + i*n, dst, n); break;
+		case 16: unpack((uint16_t *)buffer.data() + i*n, dst, n); break;
+		default: memcpy(dst, (float *)buffer.data() + i*n, n*sizeof(float));
+		}
 	}
-	uint32_t components() { return nlights; }
-	uint32_t npixels() { return size(); }
-	std::vector<Color3f> &pixel(size_t i) {
-		return this->at(i);
+	//convert count samples starting from start.
+	void load(size_t start, size_t count, PixelArray &pixels) {
+		pixels.resize(count, nlights);
+		for(size_t i = 0; i < count; i++)
+			load(start + i, pixels[i]);
 	}
 
-	//get ith sample, k light.
-	//Color3f &operator()(size_t i, size_t k) { return *(data() + i*nlights + k); }
-	//float *rawdata() { return (float *)data(); }
+protected:
+	std::vector<uint8_t> buffer;
+	std::vector<int> xs, ys;
+
+	template <class T> void pack(const float *src, T *dst, size_t n, float top) {
+		for(size_t k = 0; k < n; k++) {
+			float v = (src[k] + offset)*scale + 0.5f;
+			dst[k] = T(v < 0.0f ? 0.0f : (v > top ? top : v));
+		}
+	}
+	template <class T> void unpack(const T *src, float *dst, size_t n) {
+		float iscale = 1.0f/scale;
+		for(size_t k = 0; k < n; k++)
+			dst[k] = src[k]*iscale - offset;
+	}
 };
 
 #endif // RELIGHTVECTOR_H